@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "affinity.h"
+
+#define AFFINITY_ROLES 4
+#define AFFINITY_SPEC  1024
+
+static const char* role_[AFFINITY_ROLES] = {
+    "main", "reader", "compress", "worker",
+};
+
+static int cpus_[AFFINITY_ROLES][AFFINITY_MAX_CPUS];
+static int ncpus_[AFFINITY_ROLES];
+static int verbose_;
+
+int affinity_parse(const char* list, int* cpus, int max)
+{
+    char buf[AFFINITY_SPEC];
+    char* p = 0;
+    char* save = 0;
+    int n = 0;
+
+    strncpy(buf, list, AFFINITY_SPEC - 1);
+    buf[AFFINITY_SPEC - 1] = '\0';
+    for (p = strtok_r(buf, ",", &save); p != 0; p = strtok_r(0, ",", &save)) {
+        char* e = 0;
+        long lo = strtol(p, &e, 10);
+        long hi = lo;
+        if (e == p) {
+            return -1;
+        }
+        if (*e == '-') {
+            p = e + 1;
+            hi = strtol(p, &e, 10);
+            if (e == p) {
+                return -1;
+            }
+        }
+        if (*e != '\0' || lo < 0 || hi < lo || hi >= AFFINITY_MAX_CPUS) {
+            return -1;
+        }
+        for (; lo <= hi && n < max; ++lo) {
+            cpus[n++] = (int) lo;
+        }
+    }
+    return n > 0 ? n : -1;
+}
+
+int affinity_add(const char* spec, int v)
+{
+    const char* q = strchr(spec, '=');
+    int r;
+
+    verbose_ = v;
+    for (r = 0; q != 0 && r < AFFINITY_ROLES; ++r) {
+        if (strncmp(spec, role_[r], q - spec) == 0 &&
+            role_[r][q - spec] == '\0') {
+            break;
+        }
+    }
+    if (q == 0 || r >= AFFINITY_ROLES) {
+        fprintf(stderr, "Invalid affinity spec [%s]\n", spec);
+        return -1;
+    }
+
+    ncpus_[r] = affinity_parse(q + 1, cpus_[r], AFFINITY_MAX_CPUS);
+    if (ncpus_[r] < 0) {
+        ncpus_[r] = 0;
+        fprintf(stderr, "Invalid CPU list [%s]\n", q + 1);
+        return -1;
+    }
+    return 0;
+}
+
+void affinity_apply(int role)
+{
+#ifdef CPU_SET
+    cpu_set_t set;
+    int ret;
+    int j;
+
+    if (role < 0 || role >= AFFINITY_ROLES || ncpus_[role] == 0) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    for (j = 0; j < ncpus_[role]; ++j) {
+        CPU_SET(cpus_[role][j], &set);
+    }
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot pin %s thread to %d CPUs (%d)\n",
+                role_[role], ncpus_[role], ret);
+    } else if (verbose_) {
+        fprintf(stderr, "Pinned %s thread to %d CPUs, starting with %d\n",
+                role_[role], ncpus_[role], cpus_[role][0]);
+    }
+#endif
+}
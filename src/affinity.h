@@ -0,0 +1,24 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+// Threads that can be pinned to CPUs.
+#define AFFINITY_MAIN     0
+#define AFFINITY_READER   1
+#define AFFINITY_COMPRESS 2
+#define AFFINITY_WORKER   3
+
+#define AFFINITY_MAX_CPUS 1024
+
+// Parse a list of CPUs like 0-3,8 into cpus.  Returns how many CPUs
+// there are, or -1 if the list is invalid.
+int affinity_parse(const char* list, int* cpus, int max);
+
+// Remember the CPUs for the threads in a role, from a spec like
+//   main|reader|compress|worker=list
+// Returns -1 on errors.
+int affinity_add(const char* spec, int v);
+
+// Pin the calling thread to the CPUs given for its role, if any.
+void affinity_apply(int role);
+
+#endif
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "bench.h"
+
+#define BENCH_SPEC  1024
+#define BENCH_COUNT 100000
+#define BENCH_SIZE  64
+
+#define BENCH_DIST_FIXED   0
+#define BENCH_DIST_UNIFORM 1
+#define BENCH_DIST_EXP     2
+
+static long count_;
+static int lo_;
+static int hi_;
+static int dist_;
+static int sweep_lo_;
+static int sweep_hi_;
+static int verbose_;
+
+static char* data_;
+static int size_;
+static unsigned long long seed_;
+
+static int step_;
+static int step_lo_;
+static int step_hi_;
+static long sent_;
+static long sent_bytes_;
+static struct timespec start_;
+static struct rusage usage_;
+
+static int bench_range(const char* s, int* lo, int* hi);
+static int bench_size(void);
+static double bench_elapsed(const struct timespec* t0, const struct timespec* t1);
+static double bench_cpu(const struct rusage* r0, const struct rusage* r1);
+
+int bench_init(const char* spec, int v)
+{
+    char buf[BENCH_SPEC];
+    char* p = 0;
+    char* save = 0;
+    int steps = 1;
+    int j;
+
+    verbose_ = v;
+    count_ = BENCH_COUNT;
+    lo_ = hi_ = BENCH_SIZE;
+    dist_ = BENCH_DIST_FIXED;
+    sweep_lo_ = sweep_hi_ = 0;
+
+    strncpy(buf, spec, BENCH_SPEC - 1);
+    buf[BENCH_SPEC - 1] = '\0';
+    for (p = strtok_r(buf, ",", &save); p != 0; p = strtok_r(0, ",", &save)) {
+        if (strncmp(p, "count=", 6) == 0) {
+            count_ = atol(p + 6);
+        } else if (strncmp(p, "size=", 5) == 0) {
+            if (bench_range(p + 5, &lo_, &hi_) < 0) {
+                return -1;
+            }
+            if (lo_ != hi_ && dist_ == BENCH_DIST_FIXED) {
+                dist_ = BENCH_DIST_UNIFORM;
+            }
+        } else if (strcmp(p, "dist=fixed") == 0) {
+            dist_ = BENCH_DIST_FIXED;
+        } else if (strcmp(p, "dist=uniform") == 0) {
+            dist_ = BENCH_DIST_UNIFORM;
+        } else if (strcmp(p, "dist=exp") == 0) {
+            dist_ = BENCH_DIST_EXP;
+        } else if (strncmp(p, "sweep=", 6) == 0) {
+            if (bench_range(p + 6, &sweep_lo_, &sweep_hi_) < 0) {
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Invalid bench option [%s]\n", p);
+            return -1;
+        }
+    }
+    if (count_ <= 0) {
+        count_ = BENCH_COUNT;
+    }
+
+    size_ = hi_;
+    if (sweep_hi_ > 0) {
+        int s;
+        for (steps = 1, s = sweep_lo_; s < sweep_hi_; s *= 2) {
+            ++steps;
+        }
+        size_ = sweep_hi_;
+    }
+
+    data_ = (char*) malloc(size_);
+    seed_ = 0x9e3779b97f4a7c15ULL;
+    for (j = 0; j < size_; ++j) {
+        seed_ ^= seed_ << 13;
+        seed_ ^= seed_ >> 7;
+        seed_ ^= seed_ << 17;
+        data_[j] = (seed_ % 8) == 0 ? ' ' : (char) ('a' + seed_ % 26);
+    }
+
+    printf("# %ld records per step, %s sizes %d-%d, %d steps\n",
+           count_,
+           dist_ == BENCH_DIST_EXP ? "exponential" :
+           dist_ == BENCH_DIST_UNIFORM ? "uniform" : "fixed",
+           sweep_hi_ > 0 ? sweep_lo_ : lo_,
+           sweep_hi_ > 0 ? sweep_hi_ : hi_,
+           steps);
+    printf("# %8s %10s %12s %10s %10s %12s %10s\n",
+           "size", "records", "records/s", "MB/s", "msgs", "wire MB/s",
+           "cpu us/rec");
+    return steps;
+}
+
+void bench_start(int step)
+{
+    step_ = step;
+    step_lo_ = lo_;
+    step_hi_ = hi_;
+    if (sweep_hi_ > 0) {
+        int s = sweep_lo_;
+        while (step-- > 0 && s < sweep_hi_) {
+            s *= 2;
+        }
+        if (s > sweep_hi_) {
+            s = sweep_hi_;
+        }
+        step_lo_ = step_hi_ = s;
+    }
+
+    sent_ = 0;
+    sent_bytes_ = 0;
+    getrusage(RUSAGE_SELF, &usage_);
+    clock_gettime(CLOCK_MONOTONIC, &start_);
+    if (verbose_) {
+        fprintf(stderr, "Starting bench step %d, sizes %d-%d\n",
+                step_, step_lo_, step_hi_);
+    }
+}
+
+int bench_next(char** rec)
+{
+    int len;
+
+    if (sent_ >= count_) {
+        return -1;
+    }
+
+    len = bench_size();
+    *rec = data_ + (sent_ % 61) % (size_ - len + 1);
+    ++sent_;
+    sent_bytes_ += len;
+    return len;
+}
+
+void bench_report(long msgs, long bytes)
+{
+    struct timespec now;
+    struct rusage usage;
+    double secs;
+    double cpu;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &usage);
+    secs = bench_elapsed(&start_, &now);
+    cpu = bench_cpu(&usage_, &usage);
+    if (secs <= 0) {
+        secs = 1e-9;
+    }
+
+    printf("  %8d %10ld %12.0f %10.2f %10ld %12.2f %10.3f\n",
+           step_lo_ == step_hi_ ? step_lo_ : (step_lo_ + step_hi_) / 2,
+           sent_,
+           sent_ / secs,
+           sent_bytes_ / secs / (1024 * 1024),
+           msgs,
+           bytes / secs / (1024 * 1024),
+           sent_ > 0 ? cpu * 1e6 / sent_ : 0.0);
+    fflush(stdout);
+}
+
+void bench_clean(void)
+{
+    free(data_);
+    data_ = 0;
+}
+
+static int bench_range(const char* s, int* lo, int* hi)
+{
+    char* e = 0;
+
+    *lo = *hi = (int) strtol(s, &e, 10);
+    if (*e == '-') {
+        *hi = (int) strtol(e + 1, &e, 10);
+    }
+    if (*e != '\0' || *lo < 1 || *hi < *lo) {
+        fprintf(stderr, "Invalid bench size range [%s]\n", s);
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_size(void)
+{
+    int len = step_lo_;
+
+    if (step_lo_ == step_hi_) {
+        return len;
+    }
+
+    seed_ ^= seed_ << 13;
+    seed_ ^= seed_ >> 7;
+    seed_ ^= seed_ << 17;
+    if (dist_ == BENCH_DIST_EXP) {
+        double u = (double) (seed_ >> 11) / (double) (1ULL << 53);
+        len = step_lo_ + (int) (-log(1.0 - u) * (step_hi_ - step_lo_) / 4);
+    } else {
+        len = step_lo_ + (int) (seed_ % (unsigned) (step_hi_ - step_lo_ + 1));
+    }
+    return len > step_hi_ ? step_hi_ : len;
+}
+
+static double bench_elapsed(const struct timespec* t0, const struct timespec* t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static double bench_cpu(const struct rusage* r0, const struct rusage* r1)
+{
+    return (r1->ru_utime.tv_sec - r0->ru_utime.tv_sec) +
+        (r1->ru_utime.tv_usec - r0->ru_utime.tv_usec) / 1e6 +
+        (r1->ru_stime.tv_sec - r0->ru_stime.tv_sec) +
+        (r1->ru_stime.tv_usec - r0->ru_stime.tv_usec) / 1e6;
+}
@@ -0,0 +1,23 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+// Set up a benchmark from a spec like
+//   [count=N][,size=bytes|min-max][,dist=fixed|uniform|exp][,sweep=min-max]
+// Returns the number of steps to run (one per size in the sweep), or -1
+// on errors.
+int bench_init(const char* spec, int v);
+
+// Get ready for the given step and start its clock.
+void bench_start(int step);
+
+// Generate the next synthetic record; *rec points into a buffer owned by
+// the benchmark.  Returns the record length, or -1 once the step is done.
+int bench_next(char** rec);
+
+// Account for what the receiving side saw, and print the results of the
+// current step.
+void bench_report(long msgs, long bytes);
+
+void bench_clean(void);
+
+#endif
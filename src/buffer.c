@@ -1,119 +1,276 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "trace.h"
 #include "buffer.h"
 
-#define BUFFER_BLOCK 10
-#define MAX_DATA 1024
+#define BUFFER_MIN_SHIFT 10
+#define BUFFER_CLASSES   21
+#define BUFFER_KEEP_MIN  16
+#define BUFFER_KEEP      (8 * 1024 * 1024)
+#define BUFFER_HUGE      (2 * 1024 * 1024)
+
+#define BLOCK_MALLOC 0
+#define BLOCK_MMAP   1
+
+typedef struct Block {
+    struct Block* next;
+    int klass;
+    int flags;
+    long size;
+} Block;
+
+typedef struct Arena {
+    _Atomic(Block*) freed;
+    atomic_long cached;
+    long keep;
+} Arena;
+
+static Arena arena[BUFFER_CLASSES];
+static _Thread_local Block* local[BUFFER_CLASSES];
+
+static atomic_long live;
+static atomic_long bytes;
+static atomic_long live_max;
+static atomic_long bytes_max;
+static atomic_long cached;
+static atomic_long allocs;
 
-static int sbuf;
-static Buffer* buffer;
 static int verbose_;
+static int huge_;
 
-static void buffer_enlarge(void);
+static int buffer_class(long size);
+static Block* buffer_new(int k, long size);
+static void buffer_release(Block* b);
+static void buffer_push(Arena* a, Block* b);
+static void buffer_raise(atomic_long* max, long v);
 
 void buffer_init(int v)
 {
+    int k;
+
     verbose_ = v;
+    for (k = 0; k < BUFFER_CLASSES; ++k) {
+        long size = 1L << (k + BUFFER_MIN_SHIFT);
+        arena[k].keep = BUFFER_KEEP / size;
+        if (arena[k].keep < BUFFER_KEEP_MIN) {
+            arena[k].keep = BUFFER_KEEP_MIN;
+        }
+    }
 }
 
-int buffer_alloc(char** data)
+void buffer_set_huge(int h)
 {
-    int pos = -1;
-    while (1) {
-        int j;
-        for (j = 0; j < sbuf; ++j) {
-            if (buffer[j].used) {
-                continue;
-            }
+    huge_ = h;
+}
+
+char* buffer_alloc(int size)
+{
+    Block* b = 0;
+    long total = (long) size + sizeof(Block);
+    int k = buffer_class(total);
 
-            buffer[j].used = 1;
-            if (buffer[j].data == 0) {
-                if (verbose_) {
-                    fprintf(stderr, "Allocating %d bytes for buffer %d\n",
-                            MAX_DATA, j);
-                }
-                buffer[j].data = malloc(MAX_DATA);
+    if (k >= 0) {
+        total = 1L << (k + BUFFER_MIN_SHIFT);
+        b = local[k];
+        if (b == 0) {
+            long n = 0;
+            Block* q;
+            b = atomic_exchange(&arena[k].freed, 0);
+            for (q = b; q != 0; q = q->next) {
+                ++n;
             }
-            pos = j;
-            break;
+            atomic_fetch_sub(&arena[k].cached, n);
         }
-
-        if (pos >= 0) {
-            break;
+        if (b != 0) {
+            local[k] = b->next;
+            atomic_fetch_sub_explicit(&cached, 1, memory_order_relaxed);
         }
-        buffer_enlarge();
     }
 
-    *data = buffer[pos].data;
-    if (verbose_) {
-        fprintf(stderr, "Will use buffer %d:%p\n", pos, data);
+    if (b == 0) {
+        b = buffer_new(k, total);
+        if (b == 0) {
+            return 0;
+        }
     }
-    return pos;
+
+    b->next = 0;
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    buffer_raise(&live_max,
+                 atomic_fetch_add_explicit(&live, 1, memory_order_relaxed) + 1);
+    buffer_raise(&bytes_max,
+                 atomic_fetch_add_explicit(&bytes, b->size, memory_order_relaxed) + b->size);
+
+    return (char*) (b + 1);
 }
 
-void buffer_free(int pos)
+void buffer_free(char* data)
 {
-    if (pos < 0 || pos >= sbuf) {
-        printf("Cannot free buffer #%d, slots are [0..%d]\n", pos, sbuf-1);
+    Block* b;
+
+    if (data == 0) {
+        return;
+    }
+
+    b = ((Block*) data) - 1;
+    atomic_fetch_sub_explicit(&live, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&bytes, b->size, memory_order_relaxed);
+
+    if (b->klass < 0 ||
+        atomic_load_explicit(&arena[b->klass].cached, memory_order_relaxed) >= arena[b->klass].keep) {
+        buffer_release(b);
         return;
     }
 
-    buffer[pos].used = 0;
+    buffer_push(&arena[b->klass], b);
+    atomic_fetch_add_explicit(&cached, 1, memory_order_relaxed);
 }
 
-void buffer_clean(void)
+int buffer_size(const char* data)
+{
+    const Block* b = ((const Block*) data) - 1;
+    return b->size - sizeof(Block);
+}
+
+void buffer_thread_done(void)
 {
-    int j;
-    for (j = 0; j < sbuf; ++j) {
-        if (buffer[j].data == 0) {
-            continue;
+    int k;
+    for (k = 0; k < BUFFER_CLASSES; ++k) {
+        while (local[k] != 0) {
+            Block* b = local[k];
+            local[k] = b->next;
+            buffer_push(&arena[k], b);
         }
+    }
+}
 
-        if (verbose_) {
-            fprintf(stderr, "Freeing %d bytes in buffer #%d:%p\n",
-                    MAX_DATA, j, buffer[j].data);
-            if (buffer[j].used) {
-                fprintf(stderr, "Buffer #%d was in use when cleaning up\n", j);
-            }
+void buffer_get_stats(BufferStats* stats)
+{
+    stats->live = atomic_load_explicit(&live, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&bytes, memory_order_relaxed);
+    stats->live_max = atomic_load_explicit(&live_max, memory_order_relaxed);
+    stats->bytes_max = atomic_load_explicit(&bytes_max, memory_order_relaxed);
+    stats->cached = atomic_load_explicit(&cached, memory_order_relaxed);
+    stats->allocs = atomic_load_explicit(&allocs, memory_order_relaxed);
+}
+
+void buffer_clean(void)
+{
+    int k;
+    long n = 0;
+
+    buffer_thread_done();
+    for (k = 0; k < BUFFER_CLASSES; ++k) {
+        Block* b = atomic_exchange(&arena[k].freed, 0);
+        atomic_store(&arena[k].cached, 0);
+        while (b != 0) {
+            Block* q = b->next;
+            buffer_release(b);
+            b = q;
+            ++n;
         }
-        free(buffer[j].data);
-        buffer[j].data = 0;
-        buffer[j].used = 0;
     }
+    atomic_store(&cached, 0);
 
     if (verbose_) {
-        fprintf(stderr, "Freeing %d buffer slots\n",
-                sbuf);
+        BufferStats stats;
+        buffer_get_stats(&stats);
+        fprintf(stderr, "Freed %ld cached buffers; %ld allocations,"
+                " at most %ld buffers / %ld bytes live\n",
+                n, stats.allocs, stats.live_max, stats.bytes_max);
+        if (stats.live > 0) {
+            fprintf(stderr, "%ld buffers were in use when cleaning up\n",
+                    stats.live);
+        }
     }
-    free(buffer);
+}
 
-    buffer = 0;
-    sbuf = 0;
+static int buffer_class(long size)
+{
+    int k = 0;
+    while ((1L << (k + BUFFER_MIN_SHIFT)) < size) {
+        if (++k >= BUFFER_CLASSES) {
+            return -1;
+        }
+    }
+    return k;
 }
 
-static void buffer_enlarge(void)
+static Block* buffer_new(int k, long size)
 {
-    int j;
-    int s = sbuf + BUFFER_BLOCK;
-    Buffer* b;
+    Block* b = 0;
+    int flags = BLOCK_MALLOC;
 
-    if (verbose_) {
-        fprintf(stderr, "Enlarging buffer slots from %d to %d\n",
-                sbuf, s);
+    if (huge_ && size >= BUFFER_HUGE) {
+        size = (size + BUFFER_HUGE - 1) / BUFFER_HUGE * BUFFER_HUGE;
+        b = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        b = mmap(0, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (b == MAP_FAILED) {
+            b = mmap(0, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (b != MAP_FAILED) {
+                madvise(b, size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        if (b == MAP_FAILED) {
+            b = 0;
+        } else {
+            flags = BLOCK_MMAP;
+        }
     }
-    b = (Buffer*) calloc(s, sizeof(Buffer));
 
-    for (j = 0; j < sbuf; ++j) {
-        b[j] = buffer[j];
+    if (b == 0) {
+        b = (Block*) malloc(size);
+        flags = BLOCK_MALLOC;
     }
-
-    if (buffer != 0) {
+    if (b == 0) {
         if (verbose_) {
-            fprintf(stderr, "Deleting old %d slots\n", sbuf);
+            fprintf(stderr, "Could not allocate %ld bytes\n", size);
         }
-        free(buffer);
+        return 0;
+    }
+
+    TRACE(TRACE_INFO, TRACE_ALLOC, b, 0, size);
+    b->next = 0;
+    b->klass = k;
+    b->flags = flags;
+    b->size = size;
+    return b;
+}
+
+static void buffer_release(Block* b)
+{
+    if (b->flags == BLOCK_MMAP) {
+        munmap(b, b->size);
+    } else {
+        free(b);
     }
+}
 
-    buffer = b;
-    sbuf = s;
+static void buffer_push(Arena* a, Block* b)
+{
+    Block* head = atomic_load_explicit(&a->freed, memory_order_relaxed);
+    do {
+        b->next = head;
+    } while (! atomic_compare_exchange_weak_explicit(&a->freed, &head, b,
+                                                     memory_order_release,
+                                                     memory_order_relaxed));
+    atomic_fetch_add_explicit(&a->cached, 1, memory_order_relaxed);
+}
+
+static void buffer_raise(atomic_long* max, long v)
+{
+    long m = atomic_load_explicit(max, memory_order_relaxed);
+    while (v > m &&
+           ! atomic_compare_exchange_weak_explicit(max, &m, v,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed)) {
+    }
 }
@@ -1,14 +1,28 @@
-#ifndef ZMQ_HH_
-#define ZMQ_HH_
+#ifndef BUFFER_H_
+#define BUFFER_H_
 
-typedef struct Buffer {
-    int used;
-    char* data;
-} Buffer;
+typedef struct BufferStats {
+    long live;       // buffers handed out and not yet freed
+    long bytes;      // bytes held by those buffers
+    long live_max;   // high-water mark for live
+    long bytes_max;  // high-water mark for bytes
+    long cached;     // free buffers kept around for reuse
+    long allocs;     // total number of allocations
+} BufferStats;
 
 void buffer_init(int v);
-int buffer_alloc(char** data);
-void buffer_free(int pos);
+void buffer_set_huge(int h);
+
+// Allocation and release may happen on any thread; buffer_free is safe to
+// call from a libzmq I/O thread.
+char* buffer_alloc(int size);
+void buffer_free(char* data);
+int buffer_size(const char* data);
+
+// Hand the calling thread's cached buffers back before it exits.
+void buffer_thread_done(void);
+
+void buffer_get_stats(BufferStats* stats);
 void buffer_clean(void);
 
 #endif
@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "buffer.h"
+#include "affinity.h"
+#include "frame.h"
+#include "compress.h"
+
+#define COMPRESS_SPEC    1024
+#define COMPRESS_DEPTH   64
+#define COMPRESS_THREADS 64
+#define COMPRESS_MIN     256
+#define COMPRESS_MAX     (256 * 1024 * 1024)
+#define COMPRESS_MAGIC   "\xff" "zc"
+#define COMPRESS_HEADER  (3 + 1 + FRAME_VARINT_MAX)
+
+typedef struct Job {
+    char* data;
+    int len;
+    CompressFree* ffn;
+    int done;
+} Job;
+
+static int codec_;
+static int level_;
+static int min_;
+static int threads_;
+static int verbose_;
+
+static Job jobs_[COMPRESS_DEPTH];
+static unsigned put_;
+static unsigned claimed_;
+static unsigned taken_;
+static int stop_;
+static int running_;
+static pthread_t worker_[COMPRESS_THREADS];
+static pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_ = PTHREAD_COND_INITIALIZER;
+
+static char* out_;
+static int out_size_;
+#ifdef HAVE_ZSTD
+static _Thread_local ZSTD_CCtx* cctx_;
+static ZSTD_DCtx* dctx_;
+#endif
+
+static void* compress_worker(void* arg);
+static void compress_job(Job* job);
+static int compress_codec(const char* src, int len, char* dst, int cap);
+static void compress_free(void* data, void* hint);
+static void compress_thread_done(void);
+
+int compress_init(const char* spec, int v)
+{
+    char buf[COMPRESS_SPEC];
+    char* p = 0;
+    char* save = 0;
+
+    verbose_ = v;
+    codec_ = -1;
+    level_ = 0;
+    min_ = COMPRESS_MIN;
+    threads_ = 0;
+
+    strncpy(buf, spec, COMPRESS_SPEC - 1);
+    buf[COMPRESS_SPEC - 1] = '\0';
+    p = strtok_r(buf, ",", &save);
+    if (p != 0 && strcmp(p, "lz4") == 0) {
+#ifdef HAVE_LZ4
+        codec_ = COMPRESS_LZ4;
+        level_ = 1;
+#endif
+    } else if (p != 0 && strcmp(p, "zstd") == 0) {
+#ifdef HAVE_ZSTD
+        codec_ = COMPRESS_ZSTD;
+        level_ = 3;
+#endif
+    } else {
+        fprintf(stderr, "Invalid compression spec [%s]\n", spec);
+        return -1;
+    }
+    if (codec_ < 0) {
+        fprintf(stderr, "Compression with %s is not available in this build\n",
+                p);
+        return -1;
+    }
+
+    while ((p = strtok_r(0, ",", &save)) != 0) {
+        if (strncmp(p, "level=", 6) == 0) {
+            level_ = atoi(p + 6);
+        } else if (strncmp(p, "min=", 4) == 0) {
+            min_ = atoi(p + 4);
+        } else if (strncmp(p, "threads=", 8) == 0) {
+            threads_ = atoi(p + 8);
+        } else {
+            fprintf(stderr, "Invalid compression option [%s]\n", p);
+            return -1;
+        }
+    }
+    if (threads_ < 0) {
+        threads_ = 0;
+    }
+    if (threads_ > COMPRESS_THREADS) {
+        threads_ = COMPRESS_THREADS;
+    }
+
+    put_ = claimed_ = taken_ = 0;
+    stop_ = 0;
+    if (verbose_) {
+        fprintf(stderr, "Compression %s: level %d, min %d bytes, %d threads\n",
+                codec_ == COMPRESS_LZ4 ? "lz4" : "zstd",
+                level_, min_, threads_);
+    }
+    return 0;
+}
+
+void compress_start(void)
+{
+    int j;
+
+    for (j = 0; j < threads_; ++j) {
+        if (pthread_create(&worker_[j], 0, compress_worker, 0) != 0) {
+            if (verbose_) {
+                fprintf(stderr, "Could not start compression thread %d\n", j);
+            }
+            break;
+        }
+    }
+    running_ = j;
+}
+
+int compress_put(char* data, int len, CompressFree* ffn)
+{
+    Job* job = 0;
+
+    pthread_mutex_lock(&lock_);
+    if (put_ - taken_ >= COMPRESS_DEPTH) {
+        pthread_mutex_unlock(&lock_);
+        return -1;
+    }
+    job = &jobs_[put_ % COMPRESS_DEPTH];
+    job->data = data;
+    job->len = len;
+    job->ffn = ffn;
+    job->done = 0;
+    ++put_;
+    if (running_ == 0) {
+        claimed_ = put_;
+        pthread_mutex_unlock(&lock_);
+        compress_job(job);
+        job->done = 1;
+        return 0;
+    }
+    pthread_cond_signal(&work_);
+    pthread_mutex_unlock(&lock_);
+    return 0;
+}
+
+int compress_get(char** data, int* len, CompressFree** ffn, int wait)
+{
+    Job* job = 0;
+
+    pthread_mutex_lock(&lock_);
+    while (1) {
+        if (taken_ == put_) {
+            pthread_mutex_unlock(&lock_);
+            return -1;
+        }
+        job = &jobs_[taken_ % COMPRESS_DEPTH];
+        if (job->done) {
+            break;
+        }
+        if (! wait) {
+            pthread_mutex_unlock(&lock_);
+            return -1;
+        }
+        pthread_cond_wait(&done_, &lock_);
+    }
+    *data = job->data;
+    *len = job->len;
+    *ffn = job->ffn;
+    ++taken_;
+    pthread_mutex_unlock(&lock_);
+    return 0;
+}
+
+int compress_pending(void)
+{
+    int n;
+    pthread_mutex_lock(&lock_);
+    n = put_ - taken_;
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+int compress_detect(const char* data, int len)
+{
+    return len >= 4 && memcmp(data, COMPRESS_MAGIC, 3) == 0;
+}
+
+int compress_unpack(const char* data, int len, char** out)
+{
+    const char* end = data + len;
+    int codec = (unsigned char) data[3];
+    unsigned size = 0;
+    int n = frame_get_varint(data + 4, end, &size);
+    int got = -1;
+
+    if (n <= 0 || size > COMPRESS_MAX) {
+        return -1;
+    }
+    data += 4 + n;
+    len = end - data;
+
+    if (codec == COMPRESS_STORED) {
+        if ((unsigned) len != size) {
+            return -1;
+        }
+        *out = (char*) data;
+        return len;
+    }
+
+    if (out_size_ < (int) size) {
+        char* p = (char*) realloc(out_, size);
+        if (p == 0) {
+            return -1;
+        }
+        out_ = p;
+        out_size_ = size;
+    }
+
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4:
+        got = LZ4_decompress_safe(data, out_, len, size);
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t r;
+        if (dctx_ == 0) {
+            dctx_ = ZSTD_createDCtx();
+        }
+        r = ZSTD_decompressDCtx(dctx_, out_, size, data, len);
+        got = ZSTD_isError(r) ? -1 : (int) r;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    if (got != (int) size) {
+        return -1;
+    }
+    *out = out_;
+    return got;
+}
+
+void compress_clean(void)
+{
+    char* data = 0;
+    int len = 0;
+    CompressFree* ffn = 0;
+    int j;
+
+    pthread_mutex_lock(&lock_);
+    stop_ = 1;
+    pthread_cond_broadcast(&work_);
+    pthread_mutex_unlock(&lock_);
+    for (j = 0; j < running_; ++j) {
+        pthread_join(worker_[j], 0);
+    }
+    if (verbose_ && running_ > 0) {
+        fprintf(stderr, "Stopped %d compression threads\n", running_);
+    }
+    running_ = 0;
+
+    while (compress_get(&data, &len, &ffn, 1) == 0) {
+        if (ffn != 0) {
+            ffn(data, 0);
+        }
+    }
+
+    compress_thread_done();
+#ifdef HAVE_ZSTD
+    if (dctx_ != 0) {
+        ZSTD_freeDCtx(dctx_);
+        dctx_ = 0;
+    }
+#endif
+    free(out_);
+    out_ = 0;
+    out_size_ = 0;
+}
+
+static void* compress_worker(void* arg)
+{
+    affinity_apply(AFFINITY_COMPRESS);
+    pthread_mutex_lock(&lock_);
+    while (1) {
+        Job* job = 0;
+        while (! stop_ && claimed_ == put_) {
+            pthread_cond_wait(&work_, &lock_);
+        }
+        if (claimed_ == put_) {
+            break;
+        }
+
+        job = &jobs_[claimed_++ % COMPRESS_DEPTH];
+        pthread_mutex_unlock(&lock_);
+        compress_job(job);
+        pthread_mutex_lock(&lock_);
+        job->done = 1;
+        pthread_cond_broadcast(&done_);
+    }
+    pthread_mutex_unlock(&lock_);
+
+    compress_thread_done();
+    buffer_thread_done();
+    return 0;
+}
+
+static void compress_job(Job* job)
+{
+    int stored = compress_detect(job->data, job->len);
+    char* out = 0;
+    int n = 0;
+
+    if (job->len < min_ && ! stored) {
+        return;
+    }
+
+    out = buffer_alloc(COMPRESS_HEADER + job->len);
+    if (out == 0) {
+        return;
+    }
+    memcpy(out, COMPRESS_MAGIC, 3);
+    n = 4 + frame_put_varint(out + 4, job->len);
+
+    if (job->len >= min_) {
+        int c = compress_codec(job->data, job->len, out + n,
+                               buffer_size(out) - n);
+        if (c > 0 && n + c < job->len) {
+            out[3] = (char) codec_;
+            n += c;
+            stored = 0;
+        } else if (! stored) {
+            buffer_free(out);
+            return;
+        }
+    }
+    if (stored) {
+        out[3] = (char) COMPRESS_STORED;
+        memcpy(out + n, job->data, job->len);
+        n += job->len;
+    }
+
+    if (job->ffn != 0) {
+        job->ffn(job->data, 0);
+    }
+    job->data = out;
+    job->len = n;
+    job->ffn = compress_free;
+}
+
+static int compress_codec(const char* src, int len, char* dst, int cap)
+{
+    switch (codec_) {
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4:
+        return LZ4_compress_fast(src, dst, len, cap, level_);
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t r;
+        if (cctx_ == 0) {
+            cctx_ = ZSTD_createCCtx();
+        }
+        r = ZSTD_compressCCtx(cctx_, dst, cap, src, len, level_);
+        return ZSTD_isError(r) ? -1 : (int) r;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+static void compress_free(void* data, void* hint)
+{
+    buffer_free((char*) data);
+}
+
+static void compress_thread_done(void)
+{
+#ifdef HAVE_ZSTD
+    if (cctx_ != 0) {
+        ZSTD_freeCCtx(cctx_);
+        cctx_ = 0;
+    }
+#endif
+}
@@ -0,0 +1,39 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#define COMPRESS_STORED 0
+#define COMPRESS_LZ4    1
+#define COMPRESS_ZSTD   2
+
+// Same shape as zmq_free_fn.
+typedef void (CompressFree)(void* data, void* hint);
+
+// Set up compression from a spec like
+//   codec[,level=N][,min=bytes][,threads=N]
+// where codec is lz4 or zstd.  Returns -1 on errors, including a codec
+// that was not compiled in.
+int compress_init(const char* spec, int v);
+
+// Start the worker threads, if any were asked for.
+void compress_start(void);
+
+// Hand over a message; ffn releases data once it is no longer needed.
+// Returns -1 when there is no room until some results are taken.
+int compress_put(char* data, int len, CompressFree* ffn);
+
+// Take the oldest result, in the same order messages were put; the
+// message is compressed or not, and *ffn releases it.  Returns -1 if it
+// is not ready (and wait is not set), or if nothing is pending.
+int compress_get(char** data, int* len, CompressFree** ffn, int wait);
+
+int compress_pending(void);
+
+// Check whether a received message was written by compress_put, and
+// expand it into a buffer that stays valid until the next call.
+// Returns the expanded length, or -1 if the message is corrupt.
+int compress_detect(const char* data, int len);
+int compress_unpack(const char* data, int len, char** out);
+
+void compress_clean(void);
+
+#endif
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#include "filter.h"
+
+#define FILTER_BUCKETS 8
+
+// A set of literals searched for all at once.  Each literal goes into one
+// of eight buckets, and its first two bytes set the bucket bit in a pair
+// of fingerprint tables; a position where both bytes have a bit in
+// common is a candidate, checked against the literals in those buckets.
+// With SSSE3 the tables are split into nibbles and 16 positions are
+// fingerprinted at a time with pshufb, as in Hyperscan's Teddy.
+typedef struct Set {
+    int n;
+    char* pat[FILTER_MAX];
+    int len[FILTER_MAX];
+    unsigned char t0[256];
+    unsigned char t1[256];
+#ifdef __SSSE3__
+    __m128i lo0, hi0, lo1, hi1;
+#endif
+} Set;
+
+typedef struct Field {
+    int num;
+    char* value;
+    int len;
+} Field;
+
+static int verbose_;
+static Set set_[2];
+static Field field_[FILTER_MAX];
+static int nfield_;
+
+static int filter_add_field(const char* spec);
+static void filter_build(Set* s);
+static int filter_search(const Set* s, const char* data, int len);
+static int filter_verify(const Set* s, unsigned mask, const char* p, const char* end);
+static int filter_field(const Field* f, const char* data, int len);
+
+int filter_add(int kind, const char* spec, int v)
+{
+    Set* s = 0;
+
+    verbose_ = v;
+    if (kind == FILTER_FIELD) {
+        return filter_add_field(spec);
+    }
+
+    s = &set_[kind == FILTER_DROP];
+    if (spec[0] == '\0') {
+        fprintf(stderr, "Invalid empty filter pattern\n");
+        return -1;
+    }
+    if (s->n >= FILTER_MAX) {
+        fprintf(stderr, "Too many filter patterns (max is %d): [%s]\n",
+                FILTER_MAX, spec);
+        return -1;
+    }
+    s->pat[s->n] = strdup(spec);
+    s->len[s->n] = strlen(spec);
+    ++s->n;
+    filter_build(s);
+    if (verbose_) {
+        fprintf(stderr, "Filter %s records with [%s]\n",
+                kind == FILTER_DROP ? "dropping" : "keeping", spec);
+    }
+    return 0;
+}
+
+int filter_active(void)
+{
+    return set_[0].n > 0 || set_[1].n > 0 || nfield_ > 0;
+}
+
+int filter_match(const char* data, int len)
+{
+    int j;
+
+    if (set_[1].n > 0 && filter_search(&set_[1], data, len)) {
+        return 0;
+    }
+    for (j = 0; j < nfield_; ++j) {
+        if (! filter_field(&field_[j], data, len)) {
+            return 0;
+        }
+    }
+    if (set_[0].n > 0 && ! filter_search(&set_[0], data, len)) {
+        return 0;
+    }
+    return 1;
+}
+
+void filter_clean(void)
+{
+    int j;
+    int k;
+
+    for (k = 0; k < 2; ++k) {
+        for (j = 0; j < set_[k].n; ++j) {
+            free(set_[k].pat[j]);
+        }
+        memset(&set_[k], 0, sizeof(Set));
+    }
+    for (j = 0; j < nfield_; ++j) {
+        free(field_[j].value);
+    }
+    nfield_ = 0;
+}
+
+static int filter_add_field(const char* spec)
+{
+    Field* f = &field_[nfield_];
+    char* e = 0;
+
+    if (nfield_ >= FILTER_MAX) {
+        fprintf(stderr, "Too many field filters (max is %d): [%s]\n",
+                FILTER_MAX, spec);
+        return -1;
+    }
+    f->num = (int) strtol(spec, &e, 10);
+    if (e == spec || *e != '=' || f->num < 1) {
+        fprintf(stderr, "Invalid field filter [%s]\n", spec);
+        return -1;
+    }
+    f->value = strdup(e + 1);
+    f->len = strlen(f->value);
+    ++nfield_;
+    if (verbose_) {
+        fprintf(stderr, "Filter keeping records with field %d equal to [%s]\n",
+                f->num, f->value);
+    }
+    return 0;
+}
+
+static void filter_build(Set* s)
+{
+#ifdef __SSSE3__
+    unsigned char lo0[16], hi0[16], lo1[16], hi1[16];
+#endif
+    int j;
+    int b;
+
+    memset(s->t0, 0, sizeof(s->t0));
+    memset(s->t1, 0, sizeof(s->t1));
+#ifdef __SSSE3__
+    memset(lo0, 0, sizeof(lo0));
+    memset(hi0, 0, sizeof(hi0));
+    memset(lo1, 0, sizeof(lo1));
+    memset(hi1, 0, sizeof(hi1));
+#endif
+    for (j = 0; j < s->n; ++j) {
+        unsigned char bit = 1 << (j % FILTER_BUCKETS);
+        unsigned char c0 = s->pat[j][0];
+        unsigned char c1 = s->pat[j][1];
+
+        s->t0[c0] |= bit;
+#ifdef __SSSE3__
+        lo0[c0 & 15] |= bit;
+        hi0[c0 >> 4] |= bit;
+#endif
+        // A single byte matches whatever follows it.
+        for (b = 0; b < 256; ++b) {
+            if (s->len[j] == 1 || b == c1) {
+                s->t1[b] |= bit;
+            }
+        }
+#ifdef __SSSE3__
+        for (b = 0; b < 16; ++b) {
+            if (s->len[j] == 1 || b == (c1 & 15)) {
+                lo1[b] |= bit;
+            }
+            if (s->len[j] == 1 || b == (c1 >> 4)) {
+                hi1[b] |= bit;
+            }
+        }
+#endif
+    }
+#ifdef __SSSE3__
+    s->lo0 = _mm_loadu_si128((const __m128i*) lo0);
+    s->hi0 = _mm_loadu_si128((const __m128i*) hi0);
+    s->lo1 = _mm_loadu_si128((const __m128i*) lo1);
+    s->hi1 = _mm_loadu_si128((const __m128i*) hi1);
+#endif
+}
+
+// Returns whether any literal in the set occurs in data.
+static int filter_search(const Set* s, const char* data, int len)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    const char* end = data + len;
+    int i = 0;
+
+    // The C library's search is already vectorized for one literal.
+    if (s->n == 1) {
+        return memmem(data, len, s->pat[0], s->len[0]) != 0;
+    }
+
+#ifdef __SSSE3__
+    {
+        const __m128i nib = _mm_set1_epi8(0x0f);
+        const __m128i zero = _mm_setzero_si128();
+
+        for (; i + 17 <= len; i += 16) {
+            __m128i v0 = _mm_loadu_si128((const __m128i*) (p + i));
+            __m128i v1 = _mm_loadu_si128((const __m128i*) (p + i + 1));
+            __m128i m0 = _mm_and_si128(
+                _mm_shuffle_epi8(s->lo0, _mm_and_si128(v0, nib)),
+                _mm_shuffle_epi8(s->hi0, _mm_and_si128(_mm_srli_epi16(v0, 4), nib)));
+            __m128i m1 = _mm_and_si128(
+                _mm_shuffle_epi8(s->lo1, _mm_and_si128(v1, nib)),
+                _mm_shuffle_epi8(s->hi1, _mm_and_si128(_mm_srli_epi16(v1, 4), nib)));
+            __m128i m = _mm_and_si128(m0, m1);
+            unsigned hit = ~_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) & 0xffff;
+            unsigned char mask[16];
+
+            if (hit == 0) {
+                continue;
+            }
+            _mm_storeu_si128((__m128i*) mask, m);
+            while (hit != 0) {
+                int k = __builtin_ctz(hit);
+                if (filter_verify(s, mask[k], data + i + k, end)) {
+                    return 1;
+                }
+                hit &= hit - 1;
+            }
+        }
+    }
+#endif
+
+    for (; i < len; ++i) {
+        unsigned mask = s->t0[p[i]] & (i + 1 < len ? s->t1[p[i + 1]] : 0xff);
+        if (mask != 0 && filter_verify(s, mask, data + i, end)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Check the literals in the buckets set in mask against position p.
+static int filter_verify(const Set* s, unsigned mask, const char* p, const char* end)
+{
+    int j;
+
+    for (j = 0; j < s->n; ++j) {
+        if ((mask & (1 << (j % FILTER_BUCKETS))) &&
+            s->len[j] <= end - p &&
+            memcmp(p, s->pat[j], s->len[j]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int filter_field(const Field* f, const char* data, int len)
+{
+    const char* p = data;
+    const char* end = data + len;
+    int num = 0;
+
+    // Most records will not even contain the value.
+    if (f->len > 0 && memmem(data, len, f->value, f->len) == 0) {
+        return 0;
+    }
+
+    while (p < end) {
+        const char* q = 0;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            ++p;
+        }
+        if (p == end) {
+            break;
+        }
+        for (q = p; q < end && *q != ' ' && *q != '\t'; ++q) {
+        }
+        if (++num == f->num) {
+            return q - p == f->len && memcmp(p, f->value, f->len) == 0;
+        }
+        p = q;
+    }
+    return f->len == 0 && num < f->num;
+}
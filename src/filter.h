@@ -0,0 +1,27 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+// Kinds of filters; a record is kept if it contains one of the KEEP
+// patterns (when there are any), none of the DROP patterns, and all the
+// FIELD values.
+#define FILTER_KEEP  0
+#define FILTER_DROP  1
+#define FILTER_FIELD 2
+
+#define FILTER_MAX 64
+
+// Add a filter: a literal pattern for KEEP / DROP, or a spec like N=value
+// for FIELD, where fields are numbered from 1 and separated by runs of
+// blanks, as in awk.  Returns -1 on errors.
+int filter_add(int kind, const char* spec, int v);
+
+// Whether any filters were added.
+int filter_active(void);
+
+// Check a record against all the filters; returns 1 to keep it, 0 to
+// drop it.
+int filter_match(const char* data, int len);
+
+void filter_clean(void);
+
+#endif
@@ -0,0 +1,76 @@
+#include "frame.h"
+
+int frame_varint_size(unsigned len)
+{
+    int n = 1;
+    while (len >= 0x80) {
+        len >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+int frame_put_varint(char* buf, unsigned len)
+{
+    unsigned char* p = (unsigned char*) buf;
+    int n = 0;
+    while (len >= 0x80) {
+        p[n++] = (unsigned char) (len | 0x80);
+        len >>= 7;
+    }
+    p[n++] = (unsigned char) len;
+    return n;
+}
+
+int frame_get_varint(const char* buf, const char* end, unsigned* len)
+{
+    const unsigned char* p = (const unsigned char*) buf;
+    unsigned v = 0;
+    int n;
+
+    for (n = 0; n < FRAME_VARINT_MAX; ++n) {
+        if (buf + n >= end) {
+            return 0;
+        }
+        v |= (unsigned) (p[n] & 0x7f) << (7 * n);
+        if ((p[n] & 0x80) == 0) {
+            *len = v;
+            return n + 1;
+        }
+    }
+    return -1;
+}
+
+int frame_size(int framing, unsigned len)
+{
+    return framing == FRAME_U32 ? 4 : frame_varint_size(len);
+}
+
+int frame_put(int framing, char* buf, unsigned len)
+{
+    unsigned char* p = (unsigned char*) buf;
+
+    if (framing != FRAME_U32) {
+        return frame_put_varint(buf, len);
+    }
+    p[0] = (unsigned char) (len >> 24);
+    p[1] = (unsigned char) (len >> 16);
+    p[2] = (unsigned char) (len >> 8);
+    p[3] = (unsigned char) len;
+    return 4;
+}
+
+int frame_get(int framing, const char* buf, const char* end, unsigned* len)
+{
+    const unsigned char* p = (const unsigned char*) buf;
+
+    if (framing != FRAME_U32) {
+        return frame_get_varint(buf, end, len);
+    }
+    if (end - buf < 4) {
+        return 0;
+    }
+    *len = ((unsigned) p[0] << 24) | ((unsigned) p[1] << 16) |
+           ((unsigned) p[2] << 8) | (unsigned) p[3];
+    return 4;
+}
@@ -0,0 +1,28 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+// Length prefixes used when records travel without delimiters.
+#define FRAME_DELIMITED 0
+#define FRAME_VARINT    1
+#define FRAME_U32       2
+
+#define FRAME_VARINT_MAX 5
+#define FRAME_PREFIX_MAX 5
+
+// Number of bytes needed to encode len as a varint.
+int frame_varint_size(unsigned len);
+
+// Encode len as a varint into buf; returns the number of bytes written.
+int frame_put_varint(char* buf, unsigned len);
+
+// Decode a varint from [buf, end); returns the number of bytes used, 0 if
+// more bytes are needed, or -1 if the data is not a valid varint.
+int frame_get_varint(const char* buf, const char* end, unsigned* len);
+
+// The same three operations for a given framing: a varint, or a
+// big-endian 32 bit length.
+int frame_size(int framing, unsigned len);
+int frame_put(int framing, char* buf, unsigned len);
+int frame_get(int framing, const char* buf, const char* end, unsigned* len);
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "histo.h"
+
+#define HISTO_SUB_BITS 6
+#define HISTO_SUB      (1 << HISTO_SUB_BITS)
+#define HISTO_MAX_BITS 48
+#define HISTO_BUCKETS  ((HISTO_MAX_BITS - HISTO_SUB_BITS + 1) * HISTO_SUB)
+
+struct Histo {
+    long count;
+    long max;
+    long bucket[HISTO_BUCKETS];
+};
+
+static int histo_index(long value);
+static long histo_value(int index);
+
+Histo* histo_create(void)
+{
+    return (Histo*) calloc(1, sizeof(Histo));
+}
+
+void histo_destroy(Histo* h)
+{
+    free(h);
+}
+
+void histo_add(Histo* h, long value)
+{
+    if (value < 0) {
+        value = 0;
+    }
+    ++h->bucket[histo_index(value)];
+    ++h->count;
+    if (h->max < value) {
+        h->max = value;
+    }
+}
+
+void histo_merge(Histo* into, const Histo* from)
+{
+    int j;
+
+    for (j = 0; j < HISTO_BUCKETS; ++j) {
+        into->bucket[j] += from->bucket[j];
+    }
+    into->count += from->count;
+    if (into->max < from->max) {
+        into->max = from->max;
+    }
+}
+
+void histo_reset(Histo* h)
+{
+    memset(h, 0, sizeof(Histo));
+}
+
+long histo_count(const Histo* h)
+{
+    return h->count;
+}
+
+long histo_max(const Histo* h)
+{
+    return h->max;
+}
+
+long histo_percentile(const Histo* h, double fraction)
+{
+    long want = (long) (fraction * h->count + 0.5);
+    long seen = 0;
+    int j;
+
+    if (want < 1) {
+        want = 1;
+    }
+    for (j = 0; j < HISTO_BUCKETS; ++j) {
+        seen += h->bucket[j];
+        if (seen >= want) {
+            long v = histo_value(j);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+void histo_print(const Histo* h, const char* label)
+{
+    if (h->count == 0) {
+        fprintf(stderr, "%s: no samples\n", label);
+        return;
+    }
+
+    fprintf(stderr, "%s: %ld samples, p50 %.1f us, p99 %.1f us,"
+            " p99.9 %.1f us, max %.1f us\n",
+            label, h->count,
+            histo_percentile(h, 0.50) / 1e3,
+            histo_percentile(h, 0.99) / 1e3,
+            histo_percentile(h, 0.999) / 1e3,
+            h->max / 1e3);
+}
+
+static int histo_index(long value)
+{
+    int bits;
+    int shift;
+
+    if (value < HISTO_SUB * 2) {
+        return (int) value;
+    }
+
+    bits = 63 - __builtin_clzl((unsigned long) value);
+    if (bits >= HISTO_MAX_BITS) {
+        return HISTO_BUCKETS - 1;
+    }
+    shift = bits - HISTO_SUB_BITS;
+    return HISTO_SUB * (shift + 1) + (int) ((value >> shift) - HISTO_SUB);
+}
+
+static long histo_value(int index)
+{
+    int shift = index / HISTO_SUB - 1;
+    long sub = index % HISTO_SUB + HISTO_SUB;
+
+    if (shift <= 0) {
+        return index;
+    }
+    return ((sub + 1) << shift) - 1;
+}
@@ -0,0 +1,26 @@
+#ifndef HISTO_H_
+#define HISTO_H_
+
+// Log-linear histogram of non-negative values, in the style of HDR
+// histograms: every power of two is split into 64 linear buckets, so any
+// percentile is within about 1.6% of the real value.
+typedef struct Histo Histo;
+
+Histo* histo_create(void);
+void histo_destroy(Histo* h);
+
+void histo_add(Histo* h, long value);
+void histo_merge(Histo* into, const Histo* from);
+void histo_reset(Histo* h);
+
+long histo_count(const Histo* h);
+long histo_max(const Histo* h);
+
+// Value below which the given fraction (0 to 1) of the samples fall.
+long histo_percentile(const Histo* h, double fraction);
+
+// Print count, p50, p99, p99.9 and max to stderr, taking values as
+// nanoseconds.
+void histo_print(const Histo* h, const char* label);
+
+#endif
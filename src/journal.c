@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "journal.h"
+
+#define JOURNAL_MAGIC       "zcj1"
+#define JOURNAL_VERSION     1
+#define JOURNAL_MORE        1
+#define JOURNAL_SPEC        1024
+#define JOURNAL_BUFFER      (1024 * 1024)
+#define JOURNAL_INDEX_NSEC  10000000L
+#define JOURNAL_INDEX_BYTES (1024 * 1024)
+#define JOURNAL_INDEX_MAX   4096
+#define JOURNAL_ALIGN(n)    (((n) + 7) & ~7)
+
+typedef struct Header {
+    char magic[4];
+    uint32_t version;
+    uint64_t created;
+    uint64_t reserved[2];
+} Header;
+
+typedef struct Record {
+    uint32_t len;
+    uint32_t flags;
+    uint64_t nsec;
+} Record;
+
+typedef struct Index {
+    uint64_t nsec;
+    uint64_t offset;
+} Index;
+
+static int verbose_;
+static char path_[JOURNAL_SPEC];
+
+// Writing.
+static int fd_ = -1;
+static int idx_fd_ = -1;
+static char* buf_;
+static int used_;
+static uint64_t offset_;
+static int in_msg_;
+static Index index_[JOURNAL_INDEX_MAX];
+static int nindex_;
+static long indexed_;
+static Index last_;
+
+// Replaying.
+static char* data_;
+static size_t size_;
+static size_t pos_;
+static int out_msg_;    // in the middle of a message being replayed
+static atomic_int refs_;
+static int open_;
+static double speed_;
+static long base_nsec_;
+static struct timespec base_;
+
+static long journal_now(void);
+static int journal_write(struct iovec* iov, int n);
+static long journal_seek(double secs, long first);
+static int journal_complete(void);
+static void journal_unmap(void);
+
+int journal_create(const char* path, int v)
+{
+    char name[JOURNAL_SPEC + 8];
+    Header h;
+    struct iovec iov;
+
+    verbose_ = v;
+    strncpy(path_, path, JOURNAL_SPEC - 1);
+    path_[JOURNAL_SPEC - 1] = '\0';
+    snprintf(name, sizeof(name), "%s.idx", path_);
+
+    fd_ = open(path_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    idx_fd_ = fd_ < 0 ? -1 : open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0 || idx_fd_ < 0) {
+        fprintf(stderr, "Cannot create journal [%s] (%d)\n",
+                fd_ < 0 ? path_ : name, errno);
+        journal_clean();
+        return -1;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, JOURNAL_MAGIC, 4);
+    h.version = JOURNAL_VERSION;
+    h.created = journal_now();
+    iov.iov_base = &h;
+    iov.iov_len = sizeof(h);
+    if (journal_write(&iov, 1) < 0) {
+        journal_clean();
+        return -1;
+    }
+    offset_ = sizeof(h);
+
+    buf_ = (char*) malloc(JOURNAL_BUFFER);
+    used_ = 0;
+    in_msg_ = 0;
+    nindex_ = 0;
+    indexed_ = 0;
+    last_.nsec = 0;
+    last_.offset = 0;
+    if (verbose_) {
+        fprintf(stderr, "Journal [%s] created, index in [%s]\n", path_, name);
+    }
+    return buf_ == 0 ? -1 : 0;
+}
+
+int journal_put(const char* data, int len, int more)
+{
+    static const char pad[8];
+    Record r;
+    int size = sizeof(r) + JOURNAL_ALIGN(len);
+
+    r.len = len;
+    r.flags = more ? JOURNAL_MORE : 0;
+    r.nsec = journal_now();
+
+    // Only messages are indexed, so that a seek never lands mid-message.
+    if (! in_msg_ && (indexed_ == 0 ||
+                      r.nsec - last_.nsec >= JOURNAL_INDEX_NSEC ||
+                      offset_ - last_.offset >= JOURNAL_INDEX_BYTES)) {
+        if (nindex_ == JOURNAL_INDEX_MAX && journal_flush() < 0) {
+            return -1;
+        }
+        last_.nsec = r.nsec;
+        last_.offset = offset_;
+        index_[nindex_++] = last_;
+        ++indexed_;
+    }
+    in_msg_ = more;
+    offset_ += size;
+
+    if (used_ + size > JOURNAL_BUFFER) {
+        if (journal_flush() < 0) {
+            return -1;
+        }
+        if (size > JOURNAL_BUFFER / 2) {
+            struct iovec iov[3];
+            iov[0].iov_base = &r;
+            iov[0].iov_len = sizeof(r);
+            iov[1].iov_base = (void*) data;
+            iov[1].iov_len = len;
+            iov[2].iov_base = (void*) pad;
+            iov[2].iov_len = JOURNAL_ALIGN(len) - len;
+            return journal_write(iov, 3);
+        }
+    }
+    memcpy(buf_ + used_, &r, sizeof(r));
+    memcpy(buf_ + used_ + sizeof(r), data, len);
+    memset(buf_ + used_ + sizeof(r) + len, 0, JOURNAL_ALIGN(len) - len);
+    used_ += size;
+    return 0;
+}
+
+int journal_pending(void)
+{
+    return used_;
+}
+
+int journal_flush(void)
+{
+    struct iovec iov;
+    int ret = 0;
+
+    if (fd_ < 0) {
+        return 0;
+    }
+
+    // The data goes out first, so the index never points past it.
+    iov.iov_base = buf_;
+    iov.iov_len = used_;
+    used_ = 0;
+    if (iov.iov_len > 0) {
+        ret = journal_write(&iov, 1);
+    }
+    while (ret == 0 && nindex_ > 0) {
+        ssize_t w = write(idx_fd_, index_, nindex_ * sizeof(Index));
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        ret = w == (ssize_t) (nindex_ * sizeof(Index)) ? 0 : -1;
+        nindex_ = 0;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Cannot write journal [%s] (%d)\n", path_, errno);
+    }
+    return ret;
+}
+
+int journal_open(const char* spec, int v)
+{
+    char buf[JOURNAL_SPEC];
+    char* p = 0;
+    char* save = 0;
+    double seek = 0;
+    struct stat st;
+    int fd;
+
+    verbose_ = v;
+    speed_ = 0;
+    strncpy(buf, spec, JOURNAL_SPEC - 1);
+    buf[JOURNAL_SPEC - 1] = '\0';
+    p = strtok_r(buf, ",", &save);
+    if (p == 0) {
+        fprintf(stderr, "Invalid journal spec [%s]\n", spec);
+        return -1;
+    }
+    strcpy(path_, p);
+    while ((p = strtok_r(0, ",", &save)) != 0) {
+        if (strncmp(p, "speed=", 6) == 0) {
+            speed_ = atof(p + 6);
+        } else if (strncmp(p, "seek=", 5) == 0) {
+            seek = atof(p + 5);
+        } else {
+            fprintf(stderr, "Invalid journal option [%s]\n", p);
+            return -1;
+        }
+    }
+
+    fd = open(path_, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open journal [%s] (%d)\n", path_, errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_ = st.st_size;
+    data_ = size_ < sizeof(Header) ? MAP_FAILED :
+        mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data_ == MAP_FAILED || memcmp(data_, JOURNAL_MAGIC, 4) != 0 ||
+        ((Header*) data_)->version != JOURNAL_VERSION) {
+        fprintf(stderr, "Invalid journal [%s]\n", path_);
+        if (data_ != MAP_FAILED) {
+            munmap(data_, size_);
+        }
+        data_ = 0;
+        size_ = 0;
+        return -1;
+    }
+    madvise(data_, size_, MADV_SEQUENTIAL);
+    atomic_store(&refs_, 1);
+    open_ = 1;
+
+    pos_ = sizeof(Header);
+    out_msg_ = 0;
+    base_nsec_ = -1;
+    if (seek > 0 && pos_ + sizeof(Record) <= size_) {
+        long first = ((Record*) (data_ + pos_))->nsec;
+        long target = journal_seek(seek, first);
+
+        // Skip whole messages up to the target from where the index left us.
+        while (pos_ + sizeof(Record) <= size_) {
+            Record* r = (Record*) (data_ + pos_);
+            if ((long) r->nsec >= target) {
+                break;
+            }
+            do {
+                r = (Record*) (data_ + pos_);
+                pos_ += sizeof(Record) + JOURNAL_ALIGN(r->len);
+            } while ((r->flags & JOURNAL_MORE) && pos_ + sizeof(Record) <= size_);
+        }
+    }
+
+    if (verbose_) {
+        fprintf(stderr, "Mapped journal of %lu bytes from [%s], starting at %lu, speed %g\n",
+                (unsigned long) size_, path_, (unsigned long) pos_, speed_);
+    }
+    return 0;
+}
+
+int journal_next(char** data, int* more)
+{
+    Record* r = 0;
+
+    if (pos_ + sizeof(Record) > size_) {
+        return -1;
+    }
+    r = (Record*) (data_ + pos_);
+
+    // Once the first frame of a message is out, the rest must follow, so
+    // check they are all there and only wait in front of a message.
+    if (! out_msg_ && ! journal_complete()) {
+        fprintf(stderr, "Dropping truncated message at end of journal\n");
+        pos_ = size_;
+        return -1;
+    }
+    if (speed_ > 0 && ! out_msg_) {
+        if (base_nsec_ < 0) {
+            base_nsec_ = r->nsec;
+            clock_gettime(CLOCK_MONOTONIC, &base_);
+        } else {
+            long wait = (long) ((r->nsec - base_nsec_) / speed_);
+            struct timespec ts = base_;
+            ts.tv_sec += wait / 1000000000L;
+            ts.tv_nsec += wait % 1000000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ++ts.tv_sec;
+                ts.tv_nsec -= 1000000000L;
+            }
+            if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    *data = data_ + pos_ + sizeof(Record);
+    *more = (r->flags & JOURNAL_MORE) != 0;
+    out_msg_ = *more;
+    pos_ += sizeof(Record) + JOURNAL_ALIGN(r->len);
+    return (int) r->len;
+}
+
+void journal_hold(void)
+{
+    atomic_fetch_add_explicit(&refs_, 1, memory_order_relaxed);
+}
+
+void journal_release(void* data, void* hint)
+{
+    if (atomic_fetch_sub(&refs_, 1) == 1) {
+        journal_unmap();
+    }
+}
+
+void journal_clean(void)
+{
+    if (fd_ >= 0) {
+        journal_flush();
+        if (verbose_) {
+            fprintf(stderr, "Journal [%s] closed at %lu bytes\n",
+                    path_, (unsigned long) offset_);
+        }
+        close(fd_);
+        fd_ = -1;
+    }
+    if (idx_fd_ >= 0) {
+        close(idx_fd_);
+        idx_fd_ = -1;
+    }
+    free(buf_);
+    buf_ = 0;
+
+    if (open_) {
+        open_ = 0;
+        journal_release(0, 0);
+    }
+}
+
+static long journal_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int journal_write(struct iovec* iov, int n)
+{
+    while (n > 0) {
+        ssize_t w = writev(fd_, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (n > 0 && (size_t) w >= iov->iov_len) {
+            w -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// Move to the last indexed message received at most secs after first,
+// without scanning the journal; without an index, start from the top.
+// Returns the target time.
+static long journal_seek(double secs, long first)
+{
+    char name[JOURNAL_SPEC + 8];
+    long target = first + (long) (secs * 1e9);
+    struct stat st;
+    Index* idx = 0;
+    size_t n = 0;
+    size_t lo = 0;
+    size_t hi = 0;
+    int fd;
+
+    snprintf(name, sizeof(name), "%s.idx", path_);
+    fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(Index)) {
+        if (verbose_) {
+            fprintf(stderr, "No index for journal [%s], scanning\n", path_);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return target;
+    }
+    n = st.st_size / sizeof(Index);
+    idx = (Index*) mmap(0, n * sizeof(Index), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (idx == MAP_FAILED) {
+        return target;
+    }
+
+    // Find the last entry at or before target.
+    hi = n;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((long) idx[mid].nsec <= target) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if ((long) idx[lo].nsec <= target && idx[lo].offset < size_) {
+        pos_ = idx[lo].offset;
+    }
+    if (verbose_) {
+        fprintf(stderr, "Index entry %lu of %lu puts %gs at offset %lu\n",
+                (unsigned long) lo, (unsigned long) n, secs,
+                (unsigned long) pos_);
+    }
+    munmap(idx, n * sizeof(Index));
+    return target;
+}
+
+// Whether every frame of the message at pos_ is in the journal.
+static int journal_complete(void)
+{
+    size_t pos = pos_;
+
+    while (pos + sizeof(Record) <= size_) {
+        Record* r = (Record*) (data_ + pos);
+        if (r->len > size_ - pos - sizeof(Record)) {
+            return 0;
+        }
+        if (! (r->flags & JOURNAL_MORE)) {
+            return 1;
+        }
+        pos += sizeof(Record) + JOURNAL_ALIGN(r->len);
+    }
+    return 0;
+}
+
+static void journal_unmap(void)
+{
+    if (data_ == 0) {
+        return;
+    }
+
+    if (verbose_) {
+        fprintf(stderr, "Unmapping journal of %lu bytes at %p\n",
+                (unsigned long) size_, data_);
+    }
+    munmap(data_, size_);
+    data_ = 0;
+    size_ = pos_ = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+// A journal keeps every frame received, with its boundaries and receive
+// time, so that traffic can be replayed later.  It is a header followed
+// by records, all in host byte order and 8 byte aligned so the file can
+// be used straight from a mapping:
+//
+//   header: "zcj1", u32 version, u64 creation time, 16 bytes reserved
+//   record: u32 length, u32 flags (1 if more frames follow), u64 receive
+//           time in nsec since the epoch, data, padding
+//
+// Next to it, path.idx holds a sparse index of {u64 time, u64 offset}
+// pairs, each pointing at the first frame of a message, taken every few
+// milliseconds of traffic or megabyte of data.
+
+// Create a journal at path, truncating any old one.  Returns -1 on errors.
+int journal_create(const char* path, int v);
+
+// Append one frame, stamped with the current time; more is set when
+// more frames of the same message follow.  Returns -1 on write errors.
+int journal_put(const char* data, int len, int more);
+
+// Number of bytes waiting to be written.
+int journal_pending(void);
+int journal_flush(void);
+
+// Map a journal to replay it, from a spec like
+//   path[,speed=factor][,seek=secs]
+// A speed of 0 (the default) sends as fast as possible; otherwise the
+// original gaps between messages are kept, divided by factor.  Seek skips
+// the messages received in the first secs, using the index.  Returns -1
+// on errors.
+int journal_open(const char* spec, int v);
+
+// Get the next frame, waiting first if replaying at a given speed; *data
+// points into the mapping, and *more is set when more frames follow.
+// Returns the frame length, or -1 at the end or if interrupted; a message
+// cut short at the end is dropped whole, so once its first frame is
+// returned, the rest of it always follows.
+int journal_next(char** data, int* more);
+
+// Keep the mapping alive for one more message; journal_release matches
+// zmq_free_fn and drops that reference again.
+void journal_hold(void);
+void journal_release(void* data, void* hint);
+
+// Flush and close a journal being written, or drop our own reference to
+// one being replayed.
+void journal_clean(void);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "key.h"
+
+#define KEY_ALL   0
+#define KEY_FIELD 1
+#define KEY_BYTES 2
+
+static int kind_;
+static int lo_;
+static int hi_;
+
+static int key_find(const char* data, int len, const char** key);
+
+int key_init(const char* spec)
+{
+    char* e = 0;
+
+    kind_ = KEY_ALL;
+    if (strncmp(spec, "field=", 6) == 0) {
+        kind_ = KEY_FIELD;
+        lo_ = (int) strtol(spec + 6, &e, 10);
+        if (*e != '\0' || lo_ < 1) {
+            kind_ = -1;
+        }
+    } else if (strncmp(spec, "bytes=", 6) == 0) {
+        kind_ = KEY_BYTES;
+        lo_ = hi_ = (int) strtol(spec + 6, &e, 10);
+        if (*e == '-') {
+            hi_ = (int) strtol(e + 1, &e, 10);
+        }
+        if (*e != '\0' || lo_ < 1 || hi_ < lo_) {
+            kind_ = -1;
+        }
+    } else if (spec[0] != '\0') {
+        kind_ = -1;
+    }
+    if (kind_ < 0) {
+        fprintf(stderr, "Invalid key [%s]\n", spec);
+        kind_ = KEY_ALL;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t key_hash(const char* data, int len)
+{
+    const char* key = 0;
+    int klen = key_find(data, len, &key);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int j;
+
+    for (j = 0; j < klen; ++j) {
+        h ^= (unsigned char) key[j];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Find the key in a record; returns its length.
+static int key_find(const char* data, int len, const char** key)
+{
+    const char* p = data;
+    const char* end = data + len;
+    int num = 0;
+
+    *key = data;
+    switch (kind_) {
+    case KEY_BYTES:
+        if (lo_ > len) {
+            return 0;
+        }
+        *key = data + lo_ - 1;
+        return (hi_ < len ? hi_ : len) - lo_ + 1;
+
+    case KEY_FIELD:
+        while (p < end) {
+            const char* q = 0;
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                ++p;
+            }
+            for (q = p; q < end && *q != ' ' && *q != '\t'; ++q) {
+            }
+            if (p < q && ++num == lo_) {
+                *key = p;
+                return q - p;
+            }
+            p = q;
+        }
+        return 0;
+
+    default:
+        return len;
+    }
+}
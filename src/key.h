@@ -0,0 +1,17 @@
+#ifndef KEY_H_
+#define KEY_H_
+
+#include <stdint.h>
+
+// Pick the part of each record that decides where it goes, from a spec
+// that is empty for the whole record, or one of
+//   field=N    field N, counting from 1, separated by runs of blanks
+//   bytes=A-B  bytes A to B, counting from 1, as in cut -b
+// Returns -1 on errors.
+int key_init(const char* spec);
+
+// Hash the key of a record with FNV-1a; records without the field or
+// bytes all get the hash of an empty key.
+uint64_t key_hash(const char* data, int len);
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "frame.h"
+#include "mapfile.h"
+
+static char delimiter_;
+static int max_;
+static int verbose_;
+static int framing_;
+
+static char* data_;
+static size_t size_;
+static size_t pos_;
+static atomic_int refs_;
+static int open_;
+
+static void mapfile_unmap(void);
+
+int mapfile_open(const char* name, char delimiter, int max, int v)
+{
+    struct stat st;
+    int fd;
+
+    delimiter_ = delimiter;
+    max_ = max;
+    verbose_ = v;
+    data_ = 0;
+    size_ = pos_ = 0;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open [%s] (%d)\n", name, errno);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot stat [%s] (%d)\n", name, errno);
+        close(fd);
+        return -1;
+    }
+
+    size_ = st.st_size;
+    if (size_ > 0) {
+        data_ = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data_ == MAP_FAILED) {
+            fprintf(stderr, "Cannot map [%s] (%d)\n", name, errno);
+            data_ = 0;
+            size_ = 0;
+            close(fd);
+            return -1;
+        }
+        madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    atomic_store(&refs_, 1);
+    open_ = 1;
+
+    if (verbose_) {
+        fprintf(stderr, "Mapped %lu bytes from [%s] at %p\n",
+                (unsigned long) size_, name, data_);
+    }
+    return 0;
+}
+
+void mapfile_set_framing(int framing)
+{
+    framing_ = framing;
+}
+
+int mapfile_next(char** rec)
+{
+    while (framing_ != FRAME_DELIMITED && pos_ < size_) {
+        char* p = data_ + pos_;
+        unsigned len = 0;
+        int n = frame_get(framing_, p, data_ + size_, &len);
+        if (n <= 0 || len > size_ - pos_ - n) {
+            fprintf(stderr, "Dropping %s record at end of file\n",
+                    n < 0 ? "invalid" : "truncated");
+            pos_ = size_;
+            break;
+        }
+
+        pos_ += n + len;
+        if (len > (unsigned) max_) {
+            fprintf(stderr, "Dropping record longer than %d bytes\n", max_);
+            continue;
+        }
+
+        *rec = p + n;
+        return (int) len;
+    }
+
+    while (pos_ < size_) {
+        char* p = data_ + pos_;
+        size_t left = size_ - pos_;
+        char* q = (char*) memchr(p, delimiter_, left);
+        size_t len = q ? (size_t) (q - p) : left;
+
+        pos_ += q ? len + 1 : len;
+        if (len > (size_t) max_) {
+            fprintf(stderr, "Dropping record longer than %d bytes\n", max_);
+            continue;
+        }
+
+        *rec = p;
+        return (int) len;
+    }
+    return -1;
+}
+
+void mapfile_hold(void)
+{
+    atomic_fetch_add_explicit(&refs_, 1, memory_order_relaxed);
+}
+
+void mapfile_release(void* data, void* hint)
+{
+    if (atomic_fetch_sub(&refs_, 1) == 1) {
+        mapfile_unmap();
+    }
+}
+
+void mapfile_clean(void)
+{
+    if (! open_) {
+        return;
+    }
+
+    open_ = 0;
+    mapfile_release(0, 0);
+}
+
+static void mapfile_unmap(void)
+{
+    if (data_ == 0) {
+        return;
+    }
+
+    if (verbose_) {
+        fprintf(stderr, "Unmapping %lu bytes at %p\n",
+                (unsigned long) size_, data_);
+    }
+    munmap(data_, size_);
+    data_ = 0;
+    size_ = pos_ = 0;
+}
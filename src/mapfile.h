@@ -0,0 +1,23 @@
+#ifndef MAPFILE_H_
+#define MAPFILE_H_
+
+// Map a whole file to read delimited records straight out of the mapping;
+// records longer than max bytes are dropped.  Returns -1 on errors.
+int mapfile_open(const char* name, char delimiter, int max, int v);
+
+// Take records as length-prefixed frames instead (see frame.h).
+void mapfile_set_framing(int framing);
+
+// Get the next record; *rec points into the mapping.  Returns the record
+// length, or -1 at the end.
+int mapfile_next(char** rec);
+
+// Keep the mapping alive for one more message; mapfile_release matches
+// zmq_free_fn and drops that reference again.
+void mapfile_hold(void);
+void mapfile_release(void* data, void* hint);
+
+// Drop our own reference; the mapping goes away with the last message.
+void mapfile_clean(void);
+
+#endif
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "stats.h"
+#include "pool.h"
+
+#define POOL_SIZE      (64 * 1024)
+#define POOL_POLL_MSEC 100
+#define POOL_EXIT_MSEC 1000
+
+typedef struct Worker {
+    pid_t pid;
+    int in;             // coprocess stdin
+    int out;            // coprocess stdout
+    char* data;
+    int size;
+    int head;
+    int tail;
+    atomic_long busy;   // usec spent in pool_call
+    atomic_long calls;
+    long last_busy;
+    long last_calls;
+} Worker;
+
+static char delimiter_;
+static int max_;
+static int verbose_;
+
+static Worker worker_[POOL_MAX_WORKERS];
+static int nworker_;
+static atomic_long queue_;
+static atomic_long queue_max_;
+static atomic_int stop_;
+
+static int pool_spawn(Worker* k, const char* cmd);
+static int pool_write(Worker* k, const char* data, int len);
+static int pool_read(Worker* k, char** reply);
+static int pool_fill(Worker* k);
+static int pool_wait(int fd, short events);
+static int pool_reap(Worker* k, int* status);
+
+int pool_init(const char* cmd, int workers, char delimiter, int max, int v)
+{
+    int j;
+
+    delimiter_ = delimiter;
+    max_ = max;
+    verbose_ = v;
+    atomic_init(&queue_, 0);
+    atomic_init(&queue_max_, 0);
+    atomic_init(&stop_, 0);
+
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (workers > POOL_MAX_WORKERS) {
+        workers = POOL_MAX_WORKERS;
+    }
+
+    // A coprocess that dies must show up as an error, not kill zc.
+    signal(SIGPIPE, SIG_IGN);
+
+    for (nworker_ = 0; nworker_ < workers; ++nworker_) {
+        if (pool_spawn(&worker_[nworker_], cmd) < 0) {
+            fprintf(stderr, "Cannot start coprocess [%s] (%d)\n", cmd, errno);
+            pool_clean();
+            return -1;
+        }
+    }
+    if (verbose_) {
+        fprintf(stderr, "Started %d coprocesses [%s], pids", nworker_, cmd);
+        for (j = 0; j < nworker_; ++j) {
+            fprintf(stderr, " %d", (int) worker_[j].pid);
+        }
+        fprintf(stderr, "\n");
+    }
+    return nworker_;
+}
+
+int pool_call(int w, const char* data, int len, char** reply)
+{
+    Worker* k = &worker_[w];
+    long start = stats_usec();
+    int ret;
+
+    if (memchr(data, delimiter_, len) != 0) {
+        fprintf(stderr, "Rejecting request of %d bytes that contains the delimiter\n",
+                len);
+        return POOL_REJECTED;
+    }
+    ret = pool_write(k, data, len);
+    if (ret >= 0) {
+        ret = pool_read(k, reply);
+    }
+    atomic_fetch_add_explicit(&k->busy, stats_usec() - start,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&k->calls, 1, memory_order_relaxed);
+    return ret;
+}
+
+void pool_queue(int delta)
+{
+    long n = atomic_fetch_add(&queue_, delta) + delta;
+    if (n > atomic_load(&queue_max_)) {
+        atomic_store(&queue_max_, n);
+    }
+}
+
+int pool_report(char* buf, int size, double secs)
+{
+    long queue = atomic_load(&queue_);
+    int n = 0;
+    int j;
+
+    n += snprintf(buf + n, size - n, " queue %ld (max %ld) workers",
+                  queue, atomic_exchange(&queue_max_, queue));
+    for (j = 0; j < nworker_ && n < size; ++j) {
+        Worker* k = &worker_[j];
+        long busy = atomic_load_explicit(&k->busy, memory_order_relaxed);
+        long calls = atomic_load_explicit(&k->calls, memory_order_relaxed);
+        n += snprintf(buf + n, size - n, " %.0f%%/%ld",
+                      (busy - k->last_busy) / 1e4 / secs,
+                      calls - k->last_calls);
+        k->last_busy = busy;
+        k->last_calls = calls;
+    }
+    return n < size ? n : size - 1;
+}
+
+void pool_stop(void)
+{
+    atomic_store(&stop_, 1);
+}
+
+int pool_stopping(void)
+{
+    return atomic_load(&stop_);
+}
+
+void pool_clean(void)
+{
+    int j;
+
+    pool_stop();
+    // Closing stdin lets a well-behaved coprocess see EOF and exit.
+    for (j = 0; j < nworker_; ++j) {
+        close(worker_[j].in);
+        close(worker_[j].out);
+    }
+    for (j = 0; j < nworker_; ++j) {
+        Worker* k = &worker_[j];
+        int status = 0;
+        int reaped = pool_reap(k, &status);
+
+        // Others get SIGTERM, and SIGKILL if even that is ignored.
+        if (reaped == 0) {
+            kill(k->pid, SIGTERM);
+            reaped = pool_reap(k, &status);
+        }
+        if (reaped == 0) {
+            kill(k->pid, SIGKILL);
+            reaped = waitpid(k->pid, &status, 0) == k->pid;
+        }
+        if (reaped > 0 && verbose_) {
+            fprintf(stderr, "Coprocess %d exited with status %d after %ld requests\n",
+                    (int) k->pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+                    atomic_load(&k->calls));
+        }
+        free(k->data);
+        memset(k, 0, sizeof(*k));
+    }
+    nworker_ = 0;
+}
+
+static int pool_spawn(Worker* k, const char* cmd)
+{
+    int in[2];
+    int out[2];
+
+    if (pipe(in) < 0) {
+        return -1;
+    }
+    if (pipe(out) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    // Our ends must not leak into the coprocesses started later, or they
+    // would never see EOF on their stdin.
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+
+    k->pid = fork();
+    if (k->pid == 0) {
+        sigset_t none;
+        // zc keeps some signals blocked; the coprocess must not inherit that.
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, 0);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(out[1]);
+        signal(SIGPIPE, SIG_DFL);
+        execl("/bin/sh", "sh", "-c", cmd, (char*) 0);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (k->pid < 0) {
+        close(in[1]);
+        close(out[0]);
+        return -1;
+    }
+
+    // Writes must not block past pool_stop, if the coprocess stops reading.
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    k->in = in[1];
+    k->out = out[0];
+    k->size = POOL_SIZE;
+    k->data = (char*) malloc(k->size);
+    k->head = k->tail = 0;
+    atomic_init(&k->busy, 0);
+    atomic_init(&k->calls, 0);
+    k->last_busy = k->last_calls = 0;
+    return k->data == 0 ? -1 : 0;
+}
+
+static int pool_write(Worker* k, const char* data, int len)
+{
+    struct iovec iov[2];
+    int n = 2;
+
+    iov[0].iov_base = (void*) data;
+    iov[0].iov_len = len;
+    iov[1].iov_base = &delimiter_;
+    iov[1].iov_len = 1;
+    while (n > 0) {
+        ssize_t w = writev(k->in, iov + 2 - n, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && pool_wait(k->in, POLLOUT) == 0) {
+                continue;
+            }
+            return -1;
+        }
+        while (n > 0 && (size_t) w >= iov[2 - n].iov_len) {
+            w -= iov[2 - n].iov_len;
+            --n;
+        }
+        if (n > 0) {
+            iov[2 - n].iov_base = (char*) iov[2 - n].iov_base + w;
+            iov[2 - n].iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+static int pool_read(Worker* k, char** reply)
+{
+    int scan = 0;
+
+    while (1) {
+        char* q = (char*) memchr(k->data + k->head + scan, delimiter_,
+                                 k->tail - k->head - scan);
+        if (q != 0) {
+            int len = q - (k->data + k->head);
+            *reply = k->data + k->head;
+            k->head += len + 1;
+            return len;
+        }
+        scan = k->tail - k->head;
+        if (scan > max_) {
+            fprintf(stderr, "Coprocess %d sent a reply longer than %d bytes\n",
+                    (int) k->pid, max_);
+            return -1;
+        }
+        if (pool_fill(k) <= 0) {
+            return -1;
+        }
+    }
+}
+
+// Read more from the coprocess, moving what is left to the front or
+// growing the buffer first if needed.  Returns the bytes read, 0 at EOF
+// or -1 on errors or when stopping.
+static int pool_fill(Worker* k)
+{
+    ssize_t n;
+
+    if (k->head > 0) {
+        memmove(k->data, k->data + k->head, k->tail - k->head);
+        k->tail -= k->head;
+        k->head = 0;
+    }
+    if (k->tail == k->size) {
+        char* p = (char*) realloc(k->data, k->size * 2);
+        if (p == 0) {
+            return -1;
+        }
+        k->data = p;
+        k->size *= 2;
+    }
+
+    if (pool_wait(k->out, POLLIN) < 0) {
+        return -1;
+    }
+    do {
+        n = read(k->out, k->data + k->tail, k->size - k->tail);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        k->tail += n;
+    }
+    return (int) n;
+}
+
+// Wait for fd to be ready for events, checking every so often whether the
+// pool is stopping.  Returns 0 when ready, -1 on errors or when stopping.
+static int pool_wait(int fd, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    while (1) {
+        int ret;
+        if (atomic_load(&stop_)) {
+            return -1;
+        }
+        ret = poll(&pfd, 1, POOL_POLL_MSEC);
+        if (ret < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ret > 0) {
+            return 0;
+        }
+    }
+}
+
+// Wait up to POOL_EXIT_MSEC for the coprocess of k to exit.  Returns 1
+// if it did, 0 if it is still running, or -1 on errors.
+static int pool_reap(Worker* k, int* status)
+{
+    int msec;
+
+    for (msec = 0; msec < POOL_EXIT_MSEC; msec += 10) {
+        pid_t pid = waitpid(k->pid, status, WNOHANG);
+        if (pid == k->pid) {
+            return 1;
+        }
+        if (pid < 0 && errno != EINTR) {
+            return -1;
+        }
+        usleep(10 * 1000);
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#define POOL_MAX_WORKERS 64
+#define POOL_REJECTED    (-2)
+
+// Start workers long-lived coprocesses, each running sh -c cmd with its
+// stdin and stdout on pipes; a request is one record written to a
+// coprocess, and its reply is the next record read back, both ending in
+// delimiter.  Replies longer than max bytes are an error.  Returns the
+// number of coprocesses started, or -1 on errors.
+int pool_init(const char* cmd, int workers, char delimiter, int max, int v);
+
+// Send a request to the coprocess of worker w and wait for its reply;
+// *reply points into the worker's own buffer and stays valid only until
+// the next call for w.  Each worker must be driven by a single thread.
+// A request holding the delimiter would read as several records to the
+// coprocess and shift every later reply, so it is not sent at all.
+// Returns the reply length, POOL_REJECTED for such requests, or -1 if
+// the coprocess is gone or the pool is stopping.
+int pool_call(int w, const char* data, int len, char** reply);
+
+// Account for requests waiting for an idle worker.
+void pool_queue(int delta);
+
+// Append the queue depth and how busy each worker was since the last
+// report to buf; meant for stats_set_report.
+int pool_report(char* buf, int size, double secs);
+
+// Make pending and future calls return -1.
+void pool_stop(void);
+int pool_stopping(void);
+
+// Close the pipes and wait for the coprocesses to exit; any still running
+// after a second get SIGTERM, and then SIGKILL.
+void pool_clean(void);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "queue.h"
+
+#define QUEUE_SPIN 64
+#define QUEUE_LINE 64
+
+typedef struct Entry {
+    char* data;
+    int len;
+} Entry;
+
+struct Queue {
+    Entry* entry;
+    unsigned mask;
+    atomic_int closed;
+
+    _Alignas(QUEUE_LINE) atomic_uint head;
+    atomic_int waiting_get;
+
+    _Alignas(QUEUE_LINE) atomic_uint tail;
+    atomic_int waiting_put;
+
+    _Alignas(QUEUE_LINE) pthread_mutex_t lock;
+    pthread_cond_t can_get;
+    pthread_cond_t can_put;
+};
+
+static int queue_ready(Queue* q, int get);
+static int queue_wait(Queue* q, int get);
+static void queue_wake(Queue* q, atomic_int* waiting, pthread_cond_t* cond);
+
+Queue* queue_create(int size)
+{
+    Queue* q = 0;
+    unsigned s = 2;
+    while (s < (unsigned) size) {
+        s *= 2;
+    }
+
+    if (posix_memalign((void**) &q, QUEUE_LINE, sizeof(Queue)) != 0) {
+        return 0;
+    }
+    q->entry = (Entry*) calloc(s, sizeof(Entry));
+    q->mask = s - 1;
+    atomic_init(&q->closed, 0);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->waiting_get, 0);
+    atomic_init(&q->waiting_put, 0);
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->can_get, 0);
+    pthread_cond_init(&q->can_put, 0);
+    return q;
+}
+
+void queue_destroy(Queue* q)
+{
+    if (q == 0) {
+        return;
+    }
+
+    pthread_cond_destroy(&q->can_put);
+    pthread_cond_destroy(&q->can_get);
+    pthread_mutex_destroy(&q->lock);
+    free(q->entry);
+    free(q);
+}
+
+int queue_put(Queue* q, char* data, int len)
+{
+    unsigned t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    while (t - atomic_load_explicit(&q->head, memory_order_acquire) > q->mask) {
+        if (queue_wait(q, 0) < 0) {
+            return -1;
+        }
+    }
+    if (atomic_load_explicit(&q->closed, memory_order_relaxed)) {
+        return -1;
+    }
+
+    q->entry[t & q->mask].data = data;
+    q->entry[t & q->mask].len = len;
+    atomic_store(&q->tail, t + 1);
+    queue_wake(q, &q->waiting_get, &q->can_get);
+    return 0;
+}
+
+int queue_get(Queue* q, char** data, int* len)
+{
+    unsigned h = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    while (atomic_load_explicit(&q->tail, memory_order_acquire) == h) {
+        if (queue_wait(q, 1) < 0) {
+            return -1;
+        }
+    }
+
+    *data = q->entry[h & q->mask].data;
+    *len = q->entry[h & q->mask].len;
+    atomic_store(&q->head, h + 1);
+    queue_wake(q, &q->waiting_put, &q->can_put);
+    return 0;
+}
+
+void queue_close(Queue* q)
+{
+    atomic_store(&q->closed, 1);
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->can_get);
+    pthread_cond_broadcast(&q->can_put);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int queue_poll(Queue* q, int usec)
+{
+    struct timespec ts;
+
+    if (queue_ready(q, 1) || atomic_load(&q->closed)) {
+        return 1;
+    }
+    if (usec <= 0) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += usec / 1000000;
+    ts.tv_nsec += (long) (usec % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    atomic_store(&q->waiting_get, 1);
+    while (! queue_ready(q, 1) &&
+           ! atomic_load(&q->closed)) {
+        if (pthread_cond_timedwait(&q->can_get, &q->lock, &ts) != 0) {
+            break;
+        }
+    }
+    atomic_store(&q->waiting_get, 0);
+    pthread_mutex_unlock(&q->lock);
+
+    return queue_ready(q, 1) || atomic_load(&q->closed);
+}
+
+int queue_depth(Queue* q)
+{
+    return atomic_load_explicit(&q->tail, memory_order_relaxed) -
+        atomic_load_explicit(&q->head, memory_order_relaxed);
+}
+
+static int queue_ready(Queue* q, int get)
+{
+    unsigned h = atomic_load(&q->head);
+    unsigned t = atomic_load(&q->tail);
+    return get ? t != h : t - h <= q->mask;
+}
+
+static int queue_wait(Queue* q, int get)
+{
+    atomic_int* waiting = get ? &q->waiting_get : &q->waiting_put;
+    pthread_cond_t* cond = get ? &q->can_get : &q->can_put;
+    int j;
+
+    for (j = 0; j < QUEUE_SPIN; ++j) {
+        if (queue_ready(q, get)) {
+            return 0;
+        }
+        if (atomic_load_explicit(&q->closed, memory_order_relaxed)) {
+            break;
+        }
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&q->lock);
+    atomic_store(waiting, 1);
+    while (! queue_ready(q, get) &&
+           ! atomic_load(&q->closed)) {
+        pthread_cond_wait(cond, &q->lock);
+    }
+    atomic_store(waiting, 0);
+    pthread_mutex_unlock(&q->lock);
+
+    if (queue_ready(q, get)) {
+        return 0;
+    }
+    return -1;
+}
+
+static void queue_wake(Queue* q, atomic_int* waiting, pthread_cond_t* cond)
+{
+    if (! atomic_load(waiting)) {
+        return;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,26 @@
+#ifndef QUEUE_H_
+#define QUEUE_H_
+
+// Bounded single-producer / single-consumer queue of data buffers.
+typedef struct Queue Queue;
+
+Queue* queue_create(int size);
+void queue_destroy(Queue* q);
+
+// Block until there is room; returns -1 if the queue was closed.
+int queue_put(Queue* q, char* data, int len);
+
+// Block until there is an entry; returns -1 once the queue is closed
+// and empty.
+int queue_get(Queue* q, char** data, int* len);
+
+// Either side may close the queue; this wakes up the other side.
+void queue_close(Queue* q);
+
+// Wait up to usec for an entry (or the queue to be closed); returns 1 if
+// queue_get would not block, 0 otherwise.
+int queue_poll(Queue* q, int usec);
+
+int queue_depth(Queue* q);
+
+#endif
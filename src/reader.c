@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include "frame.h"
+#include "uring.h"
+#include "reader.h"
+
+#define READER_SIZE (256 * 1024)
+
+static int fd_;
+static char delimiter_;
+static int max_;
+static int verbose_;
+
+static char* data_;
+static int size_;
+static int head_;
+static int scan_;
+static int tail_;
+static int eof_;
+static int skip_;
+static int framing_;
+static long drop_;
+static Uring* uring_;
+
+static int reader_next_frame(char** rec);
+static int reader_ready(void);
+static int reader_fill(void);
+static void reader_enlarge(void);
+
+void reader_init(int fd, char delimiter, int max, int v)
+{
+    fd_ = fd;
+    delimiter_ = delimiter;
+    max_ = max;
+    verbose_ = v;
+
+    size_ = READER_SIZE;
+    data_ = (char*) malloc(size_);
+    head_ = scan_ = tail_ = 0;
+    eof_ = 0;
+    skip_ = 0;
+    drop_ = 0;
+
+    if (verbose_) {
+        fprintf(stderr, "Reader using %d bytes for fd %d\n", size_, fd_);
+    }
+}
+
+void reader_set_framing(int framing)
+{
+    framing_ = framing;
+}
+
+int reader_next(char** rec)
+{
+    if (framing_ != FRAME_DELIMITED) {
+        return reader_next_frame(rec);
+    }
+
+    while (1) {
+        int len = 0;
+        char* q = 0;
+        int end = tail_;
+        if (end - head_ > max_) {
+            end = head_ + max_ + 1;
+        }
+
+        if (end > scan_) {
+            q = (char*) memchr(data_ + scan_, delimiter_, end - scan_);
+        }
+        if (q != 0) {
+            len = q - (data_ + head_);
+            *rec = data_ + head_;
+            head_ = scan_ = head_ + len + 1;
+            if (skip_) {
+                skip_ = 0;
+                continue;
+            }
+            return len;
+        }
+        scan_ = end;
+
+        if (tail_ - head_ > max_) {
+            if (! skip_) {
+                fprintf(stderr, "Dropping record longer than %d bytes\n",
+                        max_);
+            }
+            // Whatever follows the long record's delimiter is kept; only
+            // with no delimiter buffered yet must the rest be skipped too.
+            q = (char*) memchr(data_ + scan_, delimiter_, tail_ - scan_);
+            if (q != 0) {
+                skip_ = 0;
+                head_ = scan_ = q - data_ + 1;
+            } else {
+                skip_ = 1;
+                head_ = scan_ = tail_;
+            }
+            continue;
+        }
+        if (eof_) {
+            if (head_ < tail_ && !skip_) {
+                len = tail_ - head_;
+                *rec = data_ + head_;
+                head_ = scan_ = tail_;
+                return len;
+            }
+            return -1;
+        }
+
+        reader_fill();
+    }
+}
+
+int reader_poll(int msec)
+{
+    while (1) {
+        struct pollfd pfd;
+
+        if (reader_ready()) {
+            return 1;
+        }
+        if (uring_ != 0 && uring_ready(uring_)) {
+            reader_fill();
+            continue;
+        }
+
+        pfd.fd = reader_fd();
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, msec) <= 0) {
+            return 0;
+        }
+        // With io_uring, the completion may not be for the next buffer.
+        if (uring_ == 0) {
+            reader_fill();
+        }
+        msec = 0;
+    }
+}
+
+void reader_set_uring(Uring* u)
+{
+    uring_ = u;
+}
+
+int reader_fd(void)
+{
+    return uring_ != 0 ? uring_fd(uring_) : fd_;
+}
+
+void reader_clean(void)
+{
+    if (data_ == 0) {
+        return;
+    }
+
+    if (verbose_) {
+        fprintf(stderr, "Freeing %d bytes in reader\n", size_);
+    }
+    free(data_);
+    data_ = 0;
+    size_ = head_ = scan_ = tail_ = 0;
+    uring_ = 0;
+}
+
+static int reader_next_frame(char** rec)
+{
+    while (1) {
+        unsigned len = 0;
+        int n = 0;
+
+        if (drop_ > 0) {
+            long c = tail_ - head_;
+            if (c > drop_) {
+                c = drop_;
+            }
+            head_ += c;
+            drop_ -= c;
+        }
+        if (drop_ == 0 && tail_ > head_) {
+            n = frame_get(framing_, data_ + head_, data_ + tail_, &len);
+        }
+        if (n < 0) {
+            fprintf(stderr, "Invalid length prefix, ignoring rest of input\n");
+            head_ = scan_ = tail_;
+            eof_ = 1;
+            return -1;
+        }
+        if (n > 0) {
+            if (len > (unsigned) max_) {
+                fprintf(stderr, "Dropping record longer than %d bytes\n",
+                        max_);
+                head_ += n;
+                drop_ = len;
+                continue;
+            }
+            if ((unsigned) (tail_ - head_ - n) >= len) {
+                *rec = data_ + head_ + n;
+                head_ = scan_ = head_ + n + len;
+                return len;
+            }
+        }
+        if (eof_) {
+            if (head_ < tail_ || drop_ > 0) {
+                fprintf(stderr, "Dropping truncated record at end of input\n");
+            }
+            head_ = scan_ = tail_;
+            return -1;
+        }
+
+        reader_fill();
+    }
+}
+
+static int reader_ready(void)
+{
+    unsigned len = 0;
+    int n;
+
+    if (eof_) {
+        return 1;
+    }
+    if (framing_ == FRAME_DELIMITED) {
+        return tail_ - head_ > max_ ||
+            (tail_ > scan_ &&
+             memchr(data_ + scan_, delimiter_, tail_ - scan_) != 0);
+    }
+    if (drop_ > 0) {
+        return 0;
+    }
+    n = frame_get(framing_, data_ + head_, data_ + tail_, &len);
+    return n < 0 ||
+        (n > 0 && (len > (unsigned) max_ ||
+                   (unsigned) (tail_ - head_ - n) >= len));
+}
+
+static int reader_fill(void)
+{
+    int n;
+
+    if (head_ > 0) {
+        memmove(data_, data_ + head_, tail_ - head_);
+        tail_ -= head_;
+        scan_ -= head_;
+        head_ = 0;
+    }
+    if (tail_ >= size_) {
+        reader_enlarge();
+    }
+
+    if (uring_ != 0) {
+        n = uring_read(uring_, data_ + tail_, size_ - tail_);
+    } else {
+        n = read(fd_, data_ + tail_, size_ - tail_);
+    }
+    if (n <= 0) {
+        if (verbose_) {
+            if (n < 0)
+                fprintf(stderr, "Read returned %d (%d)\n", n, errno);
+            fprintf(stderr, "Found EOF\n");
+        }
+        eof_ = 1;
+        return 0;
+    }
+
+    tail_ += n;
+    return n;
+}
+
+static void reader_enlarge(void)
+{
+    int s = size_ * 2;
+    if (s > max_ + FRAME_PREFIX_MAX) {
+        s = max_ + FRAME_PREFIX_MAX;
+    }
+
+    if (verbose_) {
+        fprintf(stderr, "Enlarging reader from %d to %d bytes\n",
+                size_, s);
+    }
+    data_ = (char*) realloc(data_, s);
+    size_ = s;
+}
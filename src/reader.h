@@ -0,0 +1,30 @@
+#ifndef READER_H_
+#define READER_H_
+
+#include "uring.h"
+
+// Set up the reader to pull delimited records from file descriptor fd;
+// the buffer grows as needed, and records longer than max bytes are dropped.
+void reader_init(int fd, char delimiter, int max, int v);
+
+// Read records as length-prefixed frames instead (see frame.h); no
+// scanning for delimiters happens then.
+void reader_set_framing(int framing);
+
+// Get the next record; *rec points into the reader's own buffer and stays
+// valid only until the next call.  Returns the record length, or -1 at EOF.
+int reader_next(char** rec);
+
+// Wait up to msec for reader_next to have a record ready without blocking;
+// returns 1 if so, 0 otherwise.
+int reader_poll(int msec);
+
+// Read through io_uring instead of plain read calls.
+void reader_set_uring(Uring* u);
+
+// Descriptor to poll for input, which with io_uring is its eventfd.
+int reader_fd(void);
+
+void reader_clean(void);
+
+#endif
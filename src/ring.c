@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+typedef struct Point {
+    uint64_t hash;
+    int node;
+} Point;
+
+static Point point_[RING_MAX_NODES * RING_VNODES];
+static int npoint_;
+static int nnode_;
+
+static uint64_t ring_mix(uint64_t h);
+static int ring_compare(const void* a, const void* b);
+
+int ring_add(const char* name)
+{
+    int j;
+
+    if (nnode_ >= RING_MAX_NODES) {
+        fprintf(stderr, "Too many ring nodes (max is %d): [%s]\n",
+                RING_MAX_NODES, name);
+        return -1;
+    }
+    for (j = 0; j < RING_VNODES; ++j) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        const char* p = 0;
+        for (p = name; *p != '\0'; ++p) {
+            h ^= (unsigned char) *p;
+            h *= 0x100000001b3ULL;
+        }
+        point_[npoint_].hash = ring_mix(h + j);
+        point_[npoint_].node = nnode_;
+        ++npoint_;
+    }
+    qsort(point_, npoint_, sizeof(Point), ring_compare);
+    return nnode_++;
+}
+
+int ring_find(uint64_t hash)
+{
+    uint64_t h = ring_mix(hash);
+    int lo = 0;
+    int hi = npoint_;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (point_[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < npoint_ ? lo : 0;
+}
+
+int ring_node(int point)
+{
+    return point_[point].node;
+}
+
+int ring_next(int point)
+{
+    return point + 1 < npoint_ ? point + 1 : 0;
+}
+
+int ring_size(void)
+{
+    return nnode_;
+}
+
+void ring_clean(void)
+{
+    npoint_ = 0;
+    nnode_ = 0;
+}
+
+// FNV-1a alone leaves similar inputs close together; this is the
+// splitmix64 finalizer, which spreads them over the whole ring.
+static uint64_t ring_mix(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static int ring_compare(const void* a, const void* b)
+{
+    const Point* pa = (const Point*) a;
+    const Point* pb = (const Point*) b;
+
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return pa->node - pb->node;
+}
@@ -0,0 +1,28 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdint.h>
+
+#define RING_MAX_NODES 64
+#define RING_VNODES    160
+
+// A consistent hashing ring: every node gets RING_VNODES points, placed by
+// hashing its name, and a key belongs to the first point at or after its
+// own hash.  Adding or removing a node only moves the keys next to its
+// points, and the same names give the same ring in every process.
+
+// Add a node by name; returns its number, counting from 0, or -1 if there
+// are too many.
+int ring_add(const char* name);
+
+// Find the point a key hash falls on.
+int ring_find(uint64_t hash);
+
+// Node owning a point, and the point after it, going round the ring.
+int ring_node(int point);
+int ring_next(int point);
+
+int ring_size(void);
+void ring_clean(void);
+
+#endif
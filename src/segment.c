@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "segment.h"
+
+#define SEGMENT_NAME  1024
+#define SEGMENT_SIZE  (1024L * 1024 * 1024)
+#define SEGMENT_CHUNK (1024 * 1024)
+#define SEGMENT_ALIGN 4096
+
+static char path_[SEGMENT_NAME];
+static char name_[SEGMENT_NAME + 16];
+static long size_;
+static int time_;
+static int chunk_;
+static int direct_;
+static int verbose_;
+
+static int seq_;
+static int fd_ = -1;
+static int tailfd_ = -1;
+static char* buf_;
+static long off_;
+static int used_;
+static time_t opened_;
+
+static long segment_number(const char* s);
+static int segment_open(void);
+static int segment_close(void);
+static int segment_pwrite(int fd, const char* data, long len, long off);
+
+int segment_init(const char* spec, int v)
+{
+    char buf[SEGMENT_NAME];
+    char* p = 0;
+    char* save = 0;
+
+    verbose_ = v;
+    size_ = SEGMENT_SIZE;
+    time_ = 0;
+    chunk_ = SEGMENT_CHUNK;
+    direct_ = 0;
+    seq_ = 0;
+
+    strncpy(buf, spec, SEGMENT_NAME - 1);
+    buf[SEGMENT_NAME - 1] = '\0';
+    p = strtok_r(buf, ",", &save);
+    if (p == 0) {
+        fprintf(stderr, "Invalid segment spec [%s]\n", spec);
+        return -1;
+    }
+    strcpy(path_, p);
+
+    while ((p = strtok_r(0, ",", &save)) != 0) {
+        if (strncmp(p, "size=", 5) == 0) {
+            size_ = segment_number(p + 5);
+        } else if (strncmp(p, "time=", 5) == 0) {
+            time_ = atoi(p + 5);
+        } else if (strncmp(p, "chunk=", 6) == 0) {
+            chunk_ = segment_number(p + 6);
+        } else if (strcmp(p, "direct") == 0) {
+            direct_ = 1;
+        } else {
+            fprintf(stderr, "Invalid segment option [%s]\n", p);
+            return -1;
+        }
+    }
+
+    chunk_ = (chunk_ + SEGMENT_ALIGN - 1) / SEGMENT_ALIGN * SEGMENT_ALIGN;
+    if (chunk_ <= 0) {
+        chunk_ = SEGMENT_CHUNK;
+    }
+    if (posix_memalign((void**) &buf_, SEGMENT_ALIGN, chunk_) != 0) {
+        buf_ = 0;
+        fprintf(stderr, "Cannot allocate %d bytes for segments\n", chunk_);
+        return -1;
+    }
+
+    if (verbose_) {
+        fprintf(stderr, "Segments [%s]: size %ld, time %d, chunk %d%s\n",
+                path_, size_, time_, chunk_, direct_ ? ", direct" : "");
+    }
+    return segment_open();
+}
+
+int segment_writev(const struct iovec* iov, int n, int sync)
+{
+    int j;
+
+    if (fd_ < 0) {
+        return -1;
+    }
+
+    for (j = 0; j < n; ++j) {
+        const char* data = (const char*) iov[j].iov_base;
+        long len = iov[j].iov_len;
+        while (len > 0) {
+            long c = chunk_ - used_;
+            if (c > len) {
+                c = len;
+            }
+            memcpy(buf_ + used_, data, c);
+            used_ += c;
+            data += c;
+            len -= c;
+
+            if (used_ == chunk_) {
+                if (segment_pwrite(fd_, buf_, chunk_, off_) < 0) {
+                    return -1;
+                }
+                off_ += chunk_;
+                used_ = 0;
+            }
+        }
+    }
+
+    if (off_ + used_ >= size_ ||
+        (time_ > 0 && time(0) - opened_ >= time_)) {
+        if (segment_close() < 0) {
+            return -1;
+        }
+        return segment_open();
+    }
+
+    if (sync && used_ > 0) {
+        return segment_pwrite(direct_ ? tailfd_ : fd_, buf_, used_, off_);
+    }
+    return 0;
+}
+
+void segment_clean(void)
+{
+    if (fd_ >= 0) {
+        segment_close();
+    }
+    free(buf_);
+    buf_ = 0;
+}
+
+static long segment_number(const char* s)
+{
+    char* e = 0;
+    long n = strtol(s, &e, 10);
+    switch (*e) {
+    case 'k': case 'K': n *= 1024L; break;
+    case 'm': case 'M': n *= 1024L * 1024; break;
+    case 'g': case 'G': n *= 1024L * 1024 * 1024; break;
+    }
+    return n;
+}
+
+static int segment_open(void)
+{
+    while (1) {
+        int flags = O_WRONLY | O_CREAT | O_EXCL;
+        if (direct_) {
+            flags |= O_DIRECT;
+        }
+
+        sprintf(name_, "%s.%06d", path_, seq_);
+        fd_ = open(name_, flags, 0644);
+        if (fd_ >= 0) {
+            break;
+        }
+        if (errno == EEXIST) {
+            ++seq_;
+            continue;
+        }
+        if (errno == EINVAL && direct_) {
+            fprintf(stderr, "No O_DIRECT support for [%s], using buffered writes\n",
+                    name_);
+            direct_ = 0;
+            continue;
+        }
+        fprintf(stderr, "Cannot create segment [%s] (%d)\n", name_, errno);
+        return -1;
+    }
+    ++seq_;
+
+    if (direct_) {
+        tailfd_ = open(name_, O_WRONLY);
+    }
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, size_) < 0 && verbose_) {
+        fprintf(stderr, "Cannot preallocate %ld bytes for [%s] (%d)\n",
+                size_, name_, errno);
+    }
+#endif
+
+    off_ = 0;
+    used_ = 0;
+    opened_ = time(0);
+    if (verbose_) {
+        fprintf(stderr, "Opened segment [%s]\n", name_);
+    }
+    return 0;
+}
+
+static int segment_close(void)
+{
+    int ret = 0;
+    long total = off_ + used_;
+
+    if (used_ > 0) {
+        ret = segment_pwrite(direct_ ? tailfd_ : fd_, buf_, used_, off_);
+    }
+    if (ftruncate(fd_, total) < 0 && verbose_) {
+        fprintf(stderr, "Cannot truncate [%s] (%d)\n", name_, errno);
+    }
+    close(fd_);
+    fd_ = -1;
+    if (tailfd_ >= 0) {
+        close(tailfd_);
+        tailfd_ = -1;
+    }
+
+    if (total == 0) {
+        unlink(name_);
+    }
+    if (verbose_) {
+        fprintf(stderr, "Closed segment [%s] with %ld bytes\n", name_, total);
+    }
+    off_ = 0;
+    used_ = 0;
+    return ret;
+}
+
+static int segment_pwrite(int fd, const char* data, long len, long off)
+{
+    while (len > 0) {
+        ssize_t w = pwrite(fd, data, len, off);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Cannot write segment [%s] (%d)\n", name_, errno);
+            return -1;
+        }
+        data += w;
+        len -= w;
+        off += w;
+    }
+    return 0;
+}
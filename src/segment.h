@@ -0,0 +1,16 @@
+#ifndef SEGMENT_H_
+#define SEGMENT_H_
+
+struct iovec;
+
+// Set up rotating segment files from a spec like
+//   path[,size=bytes][,time=seconds][,chunk=bytes][,direct]
+// Segments are named path.000000, path.000001, ...  Returns -1 on errors.
+int segment_init(const char* spec, int v);
+
+// Append data to the current segment; matches WriterSink.
+int segment_writev(const struct iovec* iov, int n, int sync);
+
+void segment_clean(void);
+
+#endif
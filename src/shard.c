@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "buffer.h"
+#include "queue.h"
+#include "frame.h"
+#include "key.h"
+#include "shard.h"
+
+#define SHARD_SPEC  1024
+#define SHARD_CHUNK (64 * 1024)
+#define SHARD_DEPTH 64
+
+typedef struct Shard {
+    int fd;
+    pid_t pid;
+    Queue* queue;
+    pthread_t thread;
+    int running;
+    char* chunk;
+    int used;
+    long bytes;
+} Shard;
+
+static char delimiter_;
+static int framing_;
+static int verbose_;
+
+static Shard shard_[SHARD_MAX];
+static int nshard_;
+static atomic_int failed_;
+
+static int shard_open(Shard* s, int j, const char* target);
+static int shard_hand(Shard* s);
+static void* shard_thread(void* arg);
+
+int shard_init(const char* spec, char delimiter, int framing, int v)
+{
+    char* e = 0;
+    int j;
+
+    delimiter_ = delimiter;
+    framing_ = framing;
+    verbose_ = v;
+    atomic_init(&failed_, 0);
+
+    nshard_ = (int) strtol(spec, &e, 10);
+    if (*e != ':' || e[1] == '\0' || nshard_ < 1 || nshard_ > SHARD_MAX) {
+        fprintf(stderr, "Invalid shard spec [%s]\n", spec);
+        nshard_ = 0;
+        return -1;
+    }
+    if (e[1] == '|') {
+        // A child that goes away must show up as an error, not kill zc.
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    for (j = 0; j < nshard_; ++j) {
+        Shard* s = &shard_[j];
+        s->fd = -1;
+        s->pid = 0;
+        s->queue = 0;
+        s->running = 0;
+        s->chunk = 0;
+        s->used = 0;
+        s->bytes = 0;
+    }
+    for (j = 0; j < nshard_; ++j) {
+        Shard* s = &shard_[j];
+        if (shard_open(s, j, e + 1) < 0) {
+            shard_clean();
+            return -1;
+        }
+        s->queue = queue_create(SHARD_DEPTH);
+        s->running = pthread_create(&s->thread, 0, shard_thread, s) == 0;
+        if (! s->running) {
+            fprintf(stderr, "Cannot start writer thread for shard %d\n", j);
+            shard_clean();
+            return -1;
+        }
+    }
+    if (verbose_) {
+        fprintf(stderr, "Writing %d shards to [%s]\n", nshard_, e + 1);
+    }
+    return 0;
+}
+
+int shard_put(const char* data, int len)
+{
+    int extra = framing_ != FRAME_DELIMITED ? frame_size(framing_, len) : 1;
+    Shard* s = &shard_[key_hash(data, len) % nshard_];
+
+    if (atomic_load_explicit(&failed_, memory_order_relaxed)) {
+        return -1;
+    }
+
+    if (s->chunk != 0 && s->used + len + extra > buffer_size(s->chunk) &&
+        shard_hand(s) < 0) {
+        return -1;
+    }
+    if (s->chunk == 0) {
+        int size = len + extra > SHARD_CHUNK ? len + extra : SHARD_CHUNK;
+        s->chunk = buffer_alloc(size);
+        if (s->chunk == 0) {
+            return -1;
+        }
+    }
+
+    if (framing_ != FRAME_DELIMITED) {
+        s->used += frame_put(framing_, s->chunk + s->used, len);
+    }
+    memcpy(s->chunk + s->used, data, len);
+    s->used += len;
+    if (framing_ == FRAME_DELIMITED) {
+        s->chunk[s->used++] = delimiter_;
+    }
+    return 0;
+}
+
+int shard_pending(void)
+{
+    int n = 0;
+    int j;
+
+    for (j = 0; j < nshard_; ++j) {
+        n += shard_[j].used;
+    }
+    return n;
+}
+
+int shard_flush(void)
+{
+    int j;
+
+    for (j = 0; j < nshard_; ++j) {
+        if (shard_[j].used > 0 && shard_hand(&shard_[j]) < 0) {
+            return -1;
+        }
+    }
+    return atomic_load(&failed_) ? -1 : 0;
+}
+
+void shard_clean(void)
+{
+    int j;
+
+    if (nshard_ == 0) {
+        return;
+    }
+
+    shard_flush();
+    for (j = 0; j < nshard_; ++j) {
+        Shard* s = &shard_[j];
+        if (s->queue != 0) {
+            queue_close(s->queue);
+        }
+        if (s->running) {
+            pthread_join(s->thread, 0);
+            s->running = 0;
+        }
+        if (s->queue != 0) {
+            queue_destroy(s->queue);
+            s->queue = 0;
+        }
+        if (s->chunk != 0) {
+            buffer_free(s->chunk);
+            s->chunk = 0;
+            s->used = 0;
+        }
+        if (s->fd >= 0) {
+            close(s->fd);
+            s->fd = -1;
+        }
+        if (s->pid > 0) {
+            waitpid(s->pid, 0, 0);
+            s->pid = 0;
+        }
+        if (verbose_) {
+            fprintf(stderr, "Shard %d done after %ld bytes\n", j, s->bytes);
+        }
+    }
+    nshard_ = 0;
+}
+
+static int shard_open(Shard* s, int j, const char* target)
+{
+    char name[SHARD_SPEC];
+    int fds[2];
+
+    if (target[0] != '|') {
+        // The shard number replaces %d, or goes at the end.
+        const char* d = strstr(target, "%d");
+        if (d == 0) {
+            snprintf(name, sizeof(name), "%s.%d", target, j);
+        } else {
+            snprintf(name, sizeof(name), "%.*s%d%s",
+                     (int) (d - target), target, j, d + 2);
+        }
+        s->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (s->fd < 0) {
+            fprintf(stderr, "Cannot create shard [%s] (%d)\n", name, errno);
+            return -1;
+        }
+        fcntl(s->fd, F_SETFD, FD_CLOEXEC);
+        return 0;
+    }
+
+    snprintf(name, sizeof(name), "SHARD=%d; export SHARD; %s", j, target + 1);
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "Cannot create pipe for shard %d (%d)\n", j, errno);
+        return -1;
+    }
+    // Our end must not leak into the children started later.
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    s->pid = fork();
+    if (s->pid == 0) {
+        sigset_t none;
+        // zc keeps some signals blocked; the command must not inherit that.
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, 0);
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        signal(SIGPIPE, SIG_DFL);
+        execl("/bin/sh", "sh", "-c", name, (char*) 0);
+        _exit(127);
+    }
+    close(fds[0]);
+    if (s->pid < 0) {
+        fprintf(stderr, "Cannot start [%s] (%d)\n", target + 1, errno);
+        close(fds[1]);
+        s->pid = 0;
+        return -1;
+    }
+    s->fd = fds[1];
+    return 0;
+}
+
+// Hand the current chunk of a shard over to its writer thread.
+static int shard_hand(Shard* s)
+{
+    if (queue_put(s->queue, s->chunk, s->used) < 0) {
+        buffer_free(s->chunk);
+        s->chunk = 0;
+        s->used = 0;
+        return -1;
+    }
+    s->chunk = 0;
+    s->used = 0;
+    return 0;
+}
+
+static void* shard_thread(void* arg)
+{
+    Shard* s = (Shard*) arg;
+    char* data = 0;
+    int len = 0;
+    int broken = 0;
+
+    while (queue_get(s->queue, &data, &len) == 0) {
+        int done = 0;
+        while (! broken && done < len) {
+            ssize_t w = write(s->fd, data + done, len - done);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w < 0) {
+                fprintf(stderr, "Cannot write shard %d (%d)\n",
+                        (int) (s - shard_), errno);
+                atomic_store(&failed_, 1);
+                // Wakes up the main thread if it is waiting for room.
+                queue_close(s->queue);
+                broken = 1;
+                break;
+            }
+            done += w;
+        }
+        s->bytes += done;
+        buffer_free(data);
+    }
+    buffer_thread_done();
+    return 0;
+}
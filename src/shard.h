@@ -0,0 +1,28 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#define SHARD_MAX 256
+
+// Split the records read across several outputs, picking one by a hash
+// of each record's key, so that records with the same key keep their
+// order.  Every output has its own buffers and writer thread.  spec is
+//   N:path   write to N files, with the shard number replacing %d in
+//            path, or added to its end
+//   N:|cmd   pipe into N copies of sh -c cmd, each with $SHARD set
+// The key is set up with key_init (see key.h).  Records end in delimiter,
+// or get a length prefix when a framing is set (see frame.h).  Returns -1
+// on errors.
+int shard_init(const char* spec, char delimiter, int framing, int v);
+
+// Queue one record for its shard; returns -1 once an output has failed.
+int shard_put(const char* data, int len);
+
+// Number of bytes not handed to the writer threads yet.
+int shard_pending(void);
+int shard_flush(void);
+
+// Flush everything, wait for the writer threads to finish, and close the
+// outputs.
+void shard_clean(void);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "buffer.h"
+#include "stats.h"
+
+#define STATS_MB (1024.0 * 1024.0)
+#define STATS_EXTRA 1024
+
+static int msec_;
+static int verbose_;
+
+static atomic_long counter_[STATS_COUNT];
+static long last_[STATS_COUNT];
+static long last_usec_;
+static atomic_int stop_;
+static int running_;
+static pthread_t thread_;
+static StatsReport* report_;
+
+static void* stats_thread(void* arg);
+static void stats_print(void);
+
+void stats_init(int msec, int v)
+{
+    sigset_t mask;
+    int j;
+
+    msec_ = msec;
+    verbose_ = v;
+    for (j = 0; j < STATS_COUNT; ++j) {
+        atomic_init(&counter_[j], 0);
+        last_[j] = 0;
+    }
+    last_usec_ = stats_usec();
+    atomic_init(&stop_, 0);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, 0);
+    running_ = pthread_create(&thread_, 0, stats_thread, 0) == 0;
+    if (verbose_) {
+        fprintf(stderr, "Statistics every %d msec and on SIGUSR1%s\n",
+                msec_, running_ ? "" : " not available");
+    }
+}
+
+void stats_add(int counter, long n)
+{
+    atomic_store_explicit(&counter_[counter],
+                          atomic_load_explicit(&counter_[counter],
+                                               memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+void stats_set_report(StatsReport* fn)
+{
+    report_ = fn;
+}
+
+long stats_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void stats_clean(void)
+{
+    if (! running_) {
+        return;
+    }
+
+    atomic_store(&stop_, 1);
+    pthread_kill(thread_, SIGUSR1);
+    pthread_join(thread_, 0);
+    running_ = 0;
+    if (msec_ > 0) {
+        stats_print();
+    }
+}
+
+static void* stats_thread(void* arg)
+{
+    sigset_t mask;
+    struct timespec ts;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    ts.tv_sec = msec_ / 1000;
+    ts.tv_nsec = (msec_ % 1000) * 1000000L;
+
+    while (! atomic_load(&stop_)) {
+        int sig = msec_ > 0 ? sigtimedwait(&mask, 0, &ts) : sigwaitinfo(&mask, 0);
+        if (atomic_load(&stop_)) {
+            break;
+        }
+        if (sig == SIGUSR1 || (sig < 0 && errno == EAGAIN)) {
+            stats_print();
+        }
+    }
+    return 0;
+}
+
+static void stats_print(void)
+{
+    long now[STATS_COUNT];
+    long delta[STATS_COUNT];
+    long usec = stats_usec();
+    double secs = (usec - last_usec_) / 1e6;
+    BufferStats bs;
+    char extra[STATS_EXTRA];
+    int j;
+
+    for (j = 0; j < STATS_COUNT; ++j) {
+        now[j] = atomic_load_explicit(&counter_[j], memory_order_relaxed);
+        delta[j] = now[j] - last_[j];
+        last_[j] = now[j];
+    }
+    last_usec_ = usec;
+    if (secs <= 0) {
+        secs = 1e-6;
+    }
+    buffer_get_stats(&bs);
+    extra[0] = '\0';
+    if (report_ != 0) {
+        report_(extra, STATS_EXTRA, secs);
+    }
+
+    fprintf(stderr,
+            "stats: in %ld msgs %.1f MB (%.0f/s %.2f MB/s)"
+            " out %ld msgs %.1f MB (%.0f/s %.2f MB/s)"
+            " blocked recv %.3fs send %.3fs"
+            " again recv %ld send %ld"
+            " filtered %ld spilled %ld"
+            " pool %ld bufs %.1f MB (max %ld, %.1f MB)%s\n",
+            now[STATS_MSGS_IN], now[STATS_BYTES_IN] / STATS_MB,
+            delta[STATS_MSGS_IN] / secs, delta[STATS_BYTES_IN] / STATS_MB / secs,
+            now[STATS_MSGS_OUT], now[STATS_BYTES_OUT] / STATS_MB,
+            delta[STATS_MSGS_OUT] / secs, delta[STATS_BYTES_OUT] / STATS_MB / secs,
+            delta[STATS_RECV_USEC] / 1e6, delta[STATS_SEND_USEC] / 1e6,
+            delta[STATS_RECV_AGAIN], delta[STATS_SEND_AGAIN],
+            now[STATS_FILTERED], now[STATS_SPILLED],
+            bs.live, bs.bytes / STATS_MB, bs.live_max, bs.bytes_max / STATS_MB, extra);
+}
@@ -0,0 +1,35 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+// Counters kept by the main loop; each one has a single writer.
+#define STATS_MSGS_IN     0
+#define STATS_BYTES_IN    1
+#define STATS_MSGS_OUT    2
+#define STATS_BYTES_OUT   3
+#define STATS_RECV_USEC   4   // time blocked waiting to receive
+#define STATS_SEND_USEC   5   // time blocked waiting to send
+#define STATS_RECV_AGAIN  6   // receives that found nothing (EAGAIN)
+#define STATS_SEND_AGAIN  7   // sends that hit the HWM (EAGAIN)
+#define STATS_FILTERED    8   // records dropped by the filters
+#define STATS_SPILLED     9   // records routed past a full endpoint
+#define STATS_COUNT       10
+
+// Start the thread that prints a line of statistics to stderr every msec
+// milliseconds (never if msec is 0) and on SIGUSR1.  This blocks SIGUSR1
+// in the calling thread, so call it before starting any other thread.
+void stats_init(int msec, int v);
+
+void stats_add(int counter, long n);
+
+// Let a module append its own figures to every line; fn writes at most
+// size bytes into buf, given the seconds since the previous line.
+typedef int (StatsReport)(char* buf, int size, double secs);
+void stats_set_report(StatsReport* fn);
+
+// Monotonic clock in microseconds, for timing blocked calls.
+long stats_usec(void);
+
+// Stop the thread; prints one last line if running periodically.
+void stats_clean(void);
+
+#endif
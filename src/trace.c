@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "trace.h"
+
+#define TRACE_SPEC   1024
+#define TRACE_RING   4096
+#define TRACE_SAMPLE 32
+#define TRACE_LINE   (128 + TRACE_SAMPLE)
+#define TRACE_MSEC   100
+
+typedef struct Record {
+    long nsec;
+    long arg;
+    int event;
+    int len;
+    int sampled;
+    char data[TRACE_SAMPLE];
+} Record;
+
+typedef struct Ring {
+    struct Ring* next;
+    int id;
+    unsigned count;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_long dropped;
+    Record record[TRACE_RING];
+} Ring;
+
+int trace_level_;
+
+static int sample_;
+static int verbose_;
+
+static Ring* rings_;
+static int nrings_;
+static pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_ = PTHREAD_COND_INITIALIZER;
+static int stop_;
+static int running_;
+static pthread_t thread_;
+static _Thread_local Ring* ring_;
+
+static const char* name_[] = {
+    "recv", "send", "alloc", "free", "batch", "flush", "fail",
+};
+
+static void* trace_thread(void* arg);
+static Ring* trace_ring(void);
+static void trace_drain(Ring* rings);
+
+int trace_init(const char* spec, int v)
+{
+    char buf[TRACE_SPEC];
+    char* p = 0;
+    char* save = 0;
+    int level = 0;
+
+    verbose_ = v;
+    sample_ = 0;
+    if (ZC_TRACE_LEVEL == 0) {
+        fprintf(stderr, "Tracing is not available in this build\n");
+        return -1;
+    }
+
+    strncpy(buf, spec, TRACE_SPEC - 1);
+    buf[TRACE_SPEC - 1] = '\0';
+    p = strtok_r(buf, ",", &save);
+    if (p == 0 || (level = atoi(p)) < TRACE_ERROR) {
+        fprintf(stderr, "Invalid trace spec [%s]\n", spec);
+        return -1;
+    }
+    while ((p = strtok_r(0, ",", &save)) != 0) {
+        if (strncmp(p, "sample=", 7) == 0) {
+            sample_ = atoi(p + 7);
+        } else {
+            fprintf(stderr, "Invalid trace option [%s]\n", p);
+            return -1;
+        }
+    }
+
+    stop_ = 0;
+    running_ = pthread_create(&thread_, 0, trace_thread, 0) == 0;
+    if (! running_) {
+        fprintf(stderr, "Could not start trace thread\n");
+        return -1;
+    }
+    trace_level_ = level < ZC_TRACE_LEVEL ? level : ZC_TRACE_LEVEL;
+    if (verbose_) {
+        fprintf(stderr, "Tracing up to level %d, payload sample every %d\n",
+                trace_level_, sample_);
+    }
+    return 0;
+}
+
+void trace_event(int event, long arg, const char* data, int len)
+{
+    Ring* r = ring_ != 0 ? ring_ : trace_ring();
+    unsigned t;
+    Record* rec;
+    struct timespec ts;
+
+    if (r == 0) {
+        return;
+    }
+
+    t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (t - atomic_load_explicit(&r->head, memory_order_acquire) >= TRACE_RING) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    rec = &r->record[t % TRACE_RING];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->nsec = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    rec->arg = arg;
+    rec->event = event;
+    rec->len = len;
+    rec->sampled = 0;
+    if (data != 0 && sample_ > 0 && ++r->count % sample_ == 0) {
+        rec->sampled = len < TRACE_SAMPLE ? len : TRACE_SAMPLE;
+        memcpy(rec->data, data, rec->sampled);
+    }
+    atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+}
+
+void trace_clean(void)
+{
+    Ring* r;
+
+    if (running_) {
+        pthread_mutex_lock(&lock_);
+        stop_ = 1;
+        pthread_cond_signal(&wake_);
+        pthread_mutex_unlock(&lock_);
+        pthread_join(thread_, 0);
+        running_ = 0;
+    }
+    trace_level_ = 0;
+
+    // The last drain may have started before the final events came in.
+    trace_drain(rings_);
+
+    while ((r = rings_) != 0) {
+        rings_ = r->next;
+        free(r);
+    }
+    nrings_ = 0;
+}
+
+static void* trace_thread(void* arg)
+{
+    pthread_mutex_lock(&lock_);
+    while (! stop_) {
+        struct timespec ts;
+        Ring* rings;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += TRACE_MSEC * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wake_, &lock_, &ts);
+
+        // Write with the lock released, so that trace_ring does not wait
+        // for a slow stderr.
+        rings = rings_;
+        pthread_mutex_unlock(&lock_);
+        trace_drain(rings);
+        pthread_mutex_lock(&lock_);
+    }
+    pthread_mutex_unlock(&lock_);
+    return 0;
+}
+
+static Ring* trace_ring(void)
+{
+    Ring* r = (Ring*) calloc(1, sizeof(Ring));
+    if (r == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock_);
+    r->id = nrings_++;
+    r->next = rings_;
+    rings_ = r;
+    pthread_mutex_unlock(&lock_);
+    ring_ = r;
+    return r;
+}
+
+// Rings are only ever added in front of the list, and freed once this
+// thread is gone, so the list from rings on stays the same without lock_.
+static void trace_drain(Ring* rings)
+{
+    Ring* r;
+
+    for (r = rings; r != 0; r = r->next) {
+        unsigned h = atomic_load_explicit(&r->head, memory_order_relaxed);
+        unsigned t = atomic_load_explicit(&r->tail, memory_order_acquire);
+        long dropped = atomic_exchange(&r->dropped, 0);
+
+        for (; h != t; ++h) {
+            Record* rec = &r->record[h % TRACE_RING];
+            char line[TRACE_LINE];
+            int n = snprintf(line, TRACE_LINE, "trace %ld.%09ld t%d %s arg=%lx len=%d",
+                             rec->nsec / 1000000000L, rec->nsec % 1000000000L,
+                             r->id, name_[rec->event], rec->arg, rec->len);
+            if (rec->sampled > 0) {
+                n += snprintf(line + n, TRACE_LINE - n, " [%.*s]",
+                              rec->sampled, rec->data);
+            }
+            fprintf(stderr, "%s\n", line);
+        }
+        atomic_store_explicit(&r->head, h, memory_order_release);
+        if (dropped > 0) {
+            fprintf(stderr, "trace t%d dropped %ld events\n", r->id, dropped);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// Trace levels; ZC_TRACE_LEVEL sets the highest one compiled in, and
+// with the default of 0 every TRACE() disappears from the build.
+#define TRACE_ERROR 1
+#define TRACE_INFO  2
+#define TRACE_DEBUG 3
+
+#ifndef ZC_TRACE_LEVEL
+#define ZC_TRACE_LEVEL 0
+#endif
+
+// Events that can be traced.
+#define TRACE_RECV  0
+#define TRACE_SEND  1
+#define TRACE_ALLOC 2
+#define TRACE_FREE  3
+#define TRACE_BATCH 4
+#define TRACE_FLUSH 5
+#define TRACE_FAIL  6
+
+#if ZC_TRACE_LEVEL > 0
+#define TRACE(level, event, arg, data, len)                             \
+    do {                                                                \
+        if ((level) <= ZC_TRACE_LEVEL && (level) <= trace_level_)       \
+            trace_event((event), (long) (arg), (data), (len));          \
+    } while (0)
+#else
+#define TRACE(level, event, arg, data, len) do { } while (0)
+#endif
+
+extern int trace_level_;
+
+// Turn tracing on from a spec like
+//   level[,sample=N]
+// where every N-th event on each thread carries the start of its payload
+// (none if N is 0).  Events go into a ring per thread and a background
+// thread writes them out to stderr.  Returns -1 on errors, including a
+// build with ZC_TRACE_LEVEL 0.
+int trace_init(const char* spec, int v);
+
+void trace_event(int event, long arg, const char* data, int len);
+
+// Stop the background thread after writing out what is left.
+void trace_clean(void);
+
+#endif
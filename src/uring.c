@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "buffer.h"
+
+#define URING_FREE 0
+#define URING_BUSY 1
+#define URING_DONE 2
+
+#define URING_CANCEL ((uint64_t) -1)
+
+typedef struct Slot {
+    char* data;
+    int state;
+    int len;      // bytes asked for
+    int res;      // result of the read or write
+    int used;     // bytes of a read handed out so far
+    long offset;
+} Slot;
+
+struct Uring {
+    int fd;
+    int ring;
+    int event;
+    int verbose;
+    int depth;
+    int size;
+    int fixed;
+    int seekable;
+    int reading;
+    long start;
+    long offset;
+    long consumed;
+
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqe;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqe;
+    void* sq_map;
+    size_t sq_size;
+    void* cq_map;
+    size_t cq_size;
+    size_t sqe_size;
+
+    Slot slot[URING_DEPTH_MAX];
+    int next;
+    int submit;
+    int inflight;
+    int queued;
+    int pending;
+    int eof;
+    int failed;
+};
+
+static int uring_setup(Uring* u, unsigned entries);
+static void uring_prep(Uring* u, int op, int j, uint64_t target);
+static int uring_enter(Uring* u, int wait);
+static int uring_wait(Uring* u);
+static int uring_reap(Uring* u);
+static void uring_written(Uring* u, Slot* s);
+static void uring_fill(Uring* u);
+
+Uring* uring_create(int fd, int depth, int size, int v)
+{
+    Uring* u = 0;
+    struct iovec iov[URING_DEPTH_MAX];
+    struct stat st;
+    int j;
+
+    if (depth < 1 || depth > URING_DEPTH_MAX || size < 1) {
+        fprintf(stderr, "Invalid io_uring depth %d (max is %d) or size %d\n",
+                depth, URING_DEPTH_MAX, size);
+        return 0;
+    }
+
+    u = (Uring*) calloc(1, sizeof(Uring));
+    u->fd = fd;
+    u->ring = -1;
+    u->event = -1;
+    u->verbose = v;
+    u->depth = depth;
+    u->size = size;
+    if (uring_setup(u, 2 * depth) < 0) {
+        fprintf(stderr, "Cannot set up io_uring (%d)\n", errno);
+        uring_destroy(u);
+        return 0;
+    }
+
+    // Writes at explicit offsets can complete in any order; anything else
+    // must be done one at a time.
+    u->start = lseek(fd, 0, SEEK_CUR);
+    u->seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        u->start >= 0 && ! (fcntl(fd, F_GETFL) & O_APPEND);
+    u->offset = u->start;
+
+    for (j = 0; j < depth; ++j) {
+        u->slot[j].data = buffer_alloc(size);
+        iov[j].iov_base = u->slot[j].data;
+        iov[j].iov_len = size;
+    }
+    u->fixed = syscall(__NR_io_uring_register, u->ring,
+                       IORING_REGISTER_BUFFERS, iov, depth) == 0;
+    if (! u->fixed && u->verbose) {
+        fprintf(stderr, "Cannot register io_uring buffers (%d), using plain ones\n",
+                errno);
+    }
+
+    u->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (u->event < 0 ||
+        syscall(__NR_io_uring_register, u->ring,
+                IORING_REGISTER_EVENTFD, &u->event, 1) < 0) {
+        fprintf(stderr, "Cannot set up io_uring eventfd (%d)\n", errno);
+        uring_destroy(u);
+        return 0;
+    }
+
+    if (u->verbose) {
+        fprintf(stderr, "Using io_uring for fd %d: %d buffers of %d bytes, %s\n",
+                fd, depth, size,
+                u->seekable ? "all in flight" : "one in flight");
+    }
+    return u;
+}
+
+void uring_destroy(Uring* u)
+{
+    int j;
+
+    if (u == 0) {
+        return;
+    }
+
+    if (u->reading) {
+        // Reads from a pipe may never complete; take them back.
+        for (j = 0; j < u->depth; ++j) {
+            if (u->slot[j].state == URING_BUSY) {
+                uring_prep(u, IORING_OP_ASYNC_CANCEL, j, j);
+            }
+        }
+        while (u->inflight > 0) {
+            if (uring_wait(u) < 0 && errno != EINTR) {
+                break;
+            }
+        }
+        if (u->seekable) {
+            lseek(u->fd, u->start + u->consumed, SEEK_SET);
+        }
+    } else if (u->ring >= 0) {
+        uring_flush(u);
+        if (u->seekable) {
+            lseek(u->fd, u->offset, SEEK_SET);
+        }
+    }
+
+    if (u->verbose && u->ring >= 0) {
+        fprintf(stderr, "Closing io_uring for fd %d\n", u->fd);
+    }
+    if (u->sqe != 0) {
+        munmap(u->sqe, u->sqe_size);
+    }
+    if (u->cq_map != 0 && u->cq_map != u->sq_map) {
+        munmap(u->cq_map, u->cq_size);
+    }
+    if (u->sq_map != 0) {
+        munmap(u->sq_map, u->sq_size);
+    }
+    if (u->ring >= 0) {
+        close(u->ring);
+    }
+    if (u->event >= 0) {
+        close(u->event);
+    }
+    for (j = 0; j < u->depth; ++j) {
+        if (u->slot[j].data != 0) {
+            buffer_free(u->slot[j].data);
+        }
+    }
+    free(u);
+}
+
+int uring_read(Uring* u, char* data, int max)
+{
+    u->reading = 1;
+    while (1) {
+        Slot* s = &u->slot[u->next];
+
+        if (u->failed) {
+            return -1;
+        }
+        if (s->state == URING_DONE) {
+            int n = s->res - s->used;
+            if (s->res < 0) {
+                if (u->verbose) {
+                    fprintf(stderr, "Read returned -1 (%d)\n", -s->res);
+                }
+                u->failed = 1;
+                errno = -s->res;
+                return -1;
+            }
+            if (s->res == 0) {
+                u->eof = 1;
+                return 0;
+            }
+            if (n > max) {
+                n = max;
+            }
+            memcpy(data, s->data + s->used, n);
+            s->used += n;
+            u->consumed += n;
+            if (s->used == s->res) {
+                // A short read of a file is its end, even if the reads
+                // after it find that it has grown since.
+                if (u->seekable && s->res < s->len) {
+                    u->eof = 1;
+                }
+                s->state = URING_FREE;
+                u->next = (u->next + 1) % u->depth;
+                uring_fill(u);
+            }
+            return n;
+        }
+        if (u->eof) {
+            return 0;
+        }
+        if (s->state == URING_FREE) {
+            uring_fill(u);
+        }
+        if (uring_wait(u) < 0) {
+            return -1;
+        }
+    }
+}
+
+int uring_ready(Uring* u)
+{
+    if (u->failed || u->eof) {
+        return 1;
+    }
+    if (u->slot[u->next].state == URING_FREE) {
+        u->reading = 1;
+        uring_fill(u);
+    }
+    uring_reap(u);
+    return u->slot[u->next].state == URING_DONE;
+}
+
+int uring_fd(Uring* u)
+{
+    return u->event;
+}
+
+int uring_write(Uring* u, const struct iovec* iov, int n)
+{
+    size_t off = 0;
+    int j = 0;
+
+    while (j < n && ! u->failed) {
+        Slot* s = &u->slot[u->next];
+        int len = 0;
+
+        while (s->state != URING_FREE) {
+            if (uring_wait(u) < 0 && errno != EINTR) {
+                return -1;
+            }
+        }
+        while (j < n && len < u->size) {
+            size_t c = iov[j].iov_len - off;
+            if (c > (size_t) (u->size - len)) {
+                c = u->size - len;
+            }
+            memcpy(s->data + len, (const char*) iov[j].iov_base + off, c);
+            len += c;
+            off += c;
+            if (off == iov[j].iov_len) {
+                ++j;
+                off = 0;
+            }
+        }
+        if (len == 0) {
+            break;
+        }
+
+        // The buffer was filled while the previous write was in flight.
+        while (! u->seekable && u->inflight > 0) {
+            if (uring_wait(u) < 0 && errno != EINTR) {
+                return -1;
+            }
+        }
+        s->len = len;
+        s->offset = u->offset;
+        if (u->seekable) {
+            u->offset += len;
+        }
+        u->pending += len;
+        uring_prep(u, u->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+                   u->next, u->next);
+        u->next = (u->next + 1) % u->depth;
+    }
+    if (u->queued > 0 && uring_enter(u, 0) < 0 && errno != EINTR) {
+        return -1;
+    }
+    return u->failed ? -1 : 0;
+}
+
+int uring_pending(Uring* u)
+{
+    return u->pending;
+}
+
+int uring_flush(Uring* u)
+{
+    while (u->inflight > 0) {
+        if (uring_wait(u) < 0 && errno != EINTR) {
+            u->failed = 1;
+            break;
+        }
+    }
+    return u->failed ? -1 : 0;
+}
+
+static int uring_setup(Uring* u, unsigned entries)
+{
+    struct io_uring_params p;
+    char* sq = 0;
+    char* cq = 0;
+
+    memset(&p, 0, sizeof(p));
+    u->ring = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (u->ring < 0) {
+        return -1;
+    }
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && u->cq_size > u->sq_size) {
+        u->sq_size = u->cq_size;
+    }
+    u->sq_map = mmap(0, u->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->ring, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) {
+        u->sq_map = 0;
+        return -1;
+    }
+    u->cq_map = u->sq_map;
+    if (! (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_map = mmap(0, u->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->ring, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) {
+            u->cq_map = 0;
+            return -1;
+        }
+    }
+    u->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqe = (struct io_uring_sqe*) mmap(0, u->sqe_size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, u->ring,
+                                         IORING_OFF_SQES);
+    if (u->sqe == MAP_FAILED) {
+        u->sqe = 0;
+        return -1;
+    }
+
+    sq = (char*) u->sq_map;
+    cq = (char*) u->cq_map;
+    u->entries = p.sq_entries;
+    u->sq_head = (unsigned*) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (sq + p.sq_off.array);
+    u->cq_head = (unsigned*) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    u->cqe = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Queue a read or write of slot j, or the cancellation of the request
+// for slot target; it goes to the kernel on the next uring_enter.
+static void uring_prep(Uring* u, int op, int j, uint64_t target)
+{
+    Slot* s = &u->slot[j];
+    unsigned tail = *u->sq_tail;
+    unsigned idx;
+    struct io_uring_sqe* e = 0;
+
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) {
+        uring_enter(u, 0);
+    }
+    idx = tail & *u->sq_mask;
+    e = &u->sqe[idx];
+    memset(e, 0, sizeof(*e));
+    e->opcode = op;
+    if (op == IORING_OP_ASYNC_CANCEL) {
+        e->addr = target;
+        e->user_data = URING_CANCEL;
+    } else {
+        int reading = op == IORING_OP_READ_FIXED || op == IORING_OP_READ;
+        e->fd = u->fd;
+        e->addr = (uint64_t) (uintptr_t) s->data;
+        e->len = reading ? (unsigned) u->size : (unsigned) s->len;
+        e->off = u->seekable ? (uint64_t) s->offset : (uint64_t) -1;
+        if (op == IORING_OP_READ_FIXED || op == IORING_OP_WRITE_FIXED) {
+            e->buf_index = j;
+        }
+        e->user_data = target;
+        s->state = URING_BUSY;
+        s->res = 0;
+        s->used = 0;
+        ++u->inflight;
+    }
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++u->queued;
+}
+
+static int uring_enter(Uring* u, int wait)
+{
+    int n = (int) syscall(__NR_io_uring_enter, u->ring, u->queued, wait ? 1 : 0,
+                          wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+    if (n < 0) {
+        if (errno != EINTR && u->verbose) {
+            fprintf(stderr, "io_uring_enter returned %d (%d)\n", n, errno);
+        }
+        return -1;
+    }
+    u->queued -= n < u->queued ? n : u->queued;
+    return 0;
+}
+
+// Collect completions, waiting for one if there are none yet.
+static int uring_wait(Uring* u)
+{
+    if (uring_reap(u) > 0 || u->inflight == 0) {
+        return 0;
+    }
+    if (uring_enter(u, 1) < 0) {
+        return -1;
+    }
+    uring_reap(u);
+    return 0;
+}
+
+static int uring_reap(Uring* u)
+{
+    unsigned head = *u->cq_head;
+    unsigned tail;
+    uint64_t ticks;
+    int n = 0;
+
+    // Clear the eventfd first, so that a completion arriving after the
+    // check below still wakes up the next poll.
+    if (read(u->event, &ticks, sizeof(ticks)) < 0) {
+        ticks = 0;
+    }
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        struct io_uring_cqe* c = &u->cqe[head & *u->cq_mask];
+        Slot* s = 0;
+        if (c->user_data == URING_CANCEL) {
+            continue;
+        }
+        s = &u->slot[c->user_data];
+        s->res = c->res;
+        s->state = URING_DONE;
+        --u->inflight;
+        ++n;
+        if (! u->reading) {
+            uring_written(u, s);
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Check a completed write, finishing a short one with plain calls; only
+// one write to a stream is ever in flight, so the order is kept.
+static void uring_written(Uring* u, Slot* s)
+{
+    int done = s->res;
+
+    if (done < 0) {
+        if (u->verbose) {
+            fprintf(stderr, "Write returned -1 (%d)\n", -done);
+        }
+        u->failed = 1;
+    }
+    while (! u->failed && done < s->len) {
+        ssize_t w = u->seekable
+            ? pwrite(u->fd, s->data + done, s->len - done, s->offset + done)
+            : write(u->fd, s->data + done, s->len - done);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w < 0) {
+            if (u->verbose) {
+                fprintf(stderr, "Write returned %d (%d)\n", (int) w, errno);
+            }
+            u->failed = 1;
+            break;
+        }
+        done += w;
+    }
+    u->pending -= s->len;
+    s->state = URING_FREE;
+}
+
+// Keep reads in flight into every free buffer, in order, but only one at
+// a time for a stream.
+static void uring_fill(Uring* u)
+{
+    int ahead = u->seekable ? u->depth : 1;
+
+    while (! u->eof && ! u->failed && u->inflight < ahead) {
+        Slot* s = &u->slot[u->submit];
+        if (s->state != URING_FREE) {
+            break;
+        }
+        s->len = u->size;
+        s->offset = u->offset;
+        if (u->seekable) {
+            u->offset += u->size;
+        }
+        uring_prep(u, u->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                   u->submit, u->submit);
+        u->submit = (u->submit + 1) % u->depth;
+    }
+    if (u->queued > 0) {
+        uring_enter(u, 0);
+    }
+}
+
+#else
+
+Uring* uring_create(int fd, int depth, int size, int v)
+{
+    fprintf(stderr, "io_uring is not available in this build\n");
+    return 0;
+}
+
+void uring_destroy(Uring* u)
+{
+}
+
+int uring_read(Uring* u, char* data, int max)
+{
+    return -1;
+}
+
+int uring_ready(Uring* u)
+{
+    return 1;
+}
+
+int uring_fd(Uring* u)
+{
+    return -1;
+}
+
+int uring_write(Uring* u, const struct iovec* iov, int n)
+{
+    return -1;
+}
+
+int uring_pending(Uring* u)
+{
+    return 0;
+}
+
+int uring_flush(Uring* u)
+{
+    return -1;
+}
+
+#endif
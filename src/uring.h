@@ -0,0 +1,46 @@
+#ifndef URING_H_
+#define URING_H_
+
+struct iovec;
+
+#define URING_DEPTH 4
+#define URING_DEPTH_MAX 64
+#define URING_SIZE (256 * 1024)
+
+// Drive reads or writes on a file descriptor through io_uring, with up to
+// depth buffers of size bytes in flight.  The buffers come from the buffer
+// pool and are registered with the kernel, so that no pages are mapped per
+// call.  Regular files get every buffer in flight at once, each at its own
+// offset; pipes and other streams keep their order by having one read or
+// write in flight while the next buffer is being filled or consumed.
+typedef struct Uring Uring;
+
+// Returns 0 if io_uring cannot be set up, or is not in this build.
+Uring* uring_create(int fd, int depth, int size, int v);
+
+// Leaves the file offset after the last byte read or written.
+void uring_destroy(Uring* u);
+
+// Copy up to max bytes of input, in order, into data, waiting for them if
+// needed.  Returns the number of bytes, 0 at EOF, or -1 on errors or when
+// interrupted by a signal.
+int uring_read(Uring* u, char* data, int max);
+
+// Whether uring_read would return without waiting.
+int uring_ready(Uring* u);
+
+// A descriptor that polls readable when a read or write completes, for
+// zmq_poll and friends.
+int uring_fd(Uring* u);
+
+// Queue data for writing; this only waits when every buffer is in flight.
+// Returns -1 if an earlier write failed.
+int uring_write(Uring* u, const struct iovec* iov, int n);
+
+// Number of bytes written but not completed yet.
+int uring_pending(Uring* u);
+
+// Wait for every write in flight; returns -1 if any of them failed.
+int uring_flush(Uring* u);
+
+#endif
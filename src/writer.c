@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "frame.h"
+#include "writer.h"
+
+static int fd_;
+static int verbose_;
+
+static char* data_;
+static int size_;
+static int used_;
+static WriterSink sink_;
+static int dirty_;
+static int framing_;
+
+static int writer_drain(int sync);
+static int writer_out(struct iovec* iov, int n, int sync);
+static int writer_writev(struct iovec* iov, int n);
+
+void writer_init(int fd, int size, int v)
+{
+    fd_ = fd;
+    verbose_ = v;
+
+    size_ = size;
+    data_ = (char*) malloc(size_);
+    used_ = 0;
+
+    if (verbose_) {
+        fprintf(stderr, "Writer using %d bytes for fd %d\n", size_, fd_);
+    }
+}
+
+int writer_put(const char* data, int len, char delimiter)
+{
+    char prefix[FRAME_PREFIX_MAX];
+    int extra = 1;
+
+    if (framing_ != FRAME_DELIMITED) {
+        extra = frame_size(framing_, len);
+    }
+
+    if (used_ + len + extra > size_) {
+        if (len + extra > size_ / 2) {
+            struct iovec iov[3];
+            iov[0].iov_base = data_;
+            iov[0].iov_len = used_;
+            if (framing_ != FRAME_DELIMITED) {
+                iov[1].iov_base = prefix;
+                iov[1].iov_len = frame_put(framing_, prefix, len);
+                iov[2].iov_base = (void*) data;
+                iov[2].iov_len = len;
+            } else {
+                iov[1].iov_base = (void*) data;
+                iov[1].iov_len = len;
+                iov[2].iov_base = &delimiter;
+                iov[2].iov_len = 1;
+            }
+            used_ = 0;
+            return writer_out(iov, 3, 0);
+        }
+        if (writer_drain(0) < 0) {
+            return -1;
+        }
+    }
+
+    if (framing_ != FRAME_DELIMITED) {
+        used_ += frame_put(framing_, data_ + used_, len);
+        memcpy(data_ + used_, data, len);
+        used_ += len;
+        return 0;
+    }
+    memcpy(data_ + used_, data, len);
+    used_ += len;
+    data_[used_++] = delimiter;
+    return 0;
+}
+
+int writer_pending(void)
+{
+    return used_ > 0 ? used_ : dirty_;
+}
+
+int writer_flush(void)
+{
+    return writer_drain(1);
+}
+
+void writer_set_framing(int framing)
+{
+    framing_ = framing;
+}
+
+void writer_set_sink(WriterSink sink)
+{
+    sink_ = sink;
+}
+
+void writer_clean(void)
+{
+    if (data_ == 0) {
+        return;
+    }
+
+    writer_flush();
+    if (verbose_) {
+        fprintf(stderr, "Freeing %d bytes in writer\n", size_);
+    }
+    free(data_);
+    data_ = 0;
+    size_ = used_ = 0;
+}
+
+static int writer_drain(int sync)
+{
+    struct iovec iov;
+
+    iov.iov_base = data_;
+    iov.iov_len = used_;
+    used_ = 0;
+    return writer_out(&iov, iov.iov_len > 0 ? 1 : 0, sync);
+}
+
+static int writer_out(struct iovec* iov, int n, int sync)
+{
+    if (sink_ != 0) {
+        dirty_ = !sync;
+        return sink_(iov, n, sync);
+    }
+    return writer_writev(iov, n);
+}
+
+static int writer_writev(struct iovec* iov, int n)
+{
+    while (n > 0) {
+        ssize_t w = writev(fd_, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (verbose_) {
+                fprintf(stderr, "Write returned %d (%d)\n", (int) w, errno);
+            }
+            return -1;
+        }
+
+        while (n > 0 && (size_t) w >= iov->iov_len) {
+            w -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
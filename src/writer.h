@@ -0,0 +1,27 @@
+#ifndef WRITER_H_
+#define WRITER_H_
+
+struct iovec;
+
+// Optional replacement for writev on fd; sync is set when the caller asked
+// for a flush, rather than the writer running out of room.
+typedef int (*WriterSink)(const struct iovec* iov, int n, int sync);
+
+// Set up the writer to gather records into a buffer of size bytes and
+// write them out to file descriptor fd in as few calls as possible.
+void writer_init(int fd, int size, int v);
+
+// Queue one record followed by the delimiter, or preceded by its length
+// when a framing is set; returns -1 on write errors.
+int writer_put(const char* data, int len, char delimiter);
+
+// Number of bytes waiting to be written; non-zero as well while the sink
+// holds data that has not been flushed yet.
+int writer_pending(void);
+
+int writer_flush(void);
+void writer_set_framing(int framing);
+void writer_set_sink(WriterSink sink);
+void writer_clean(void);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "getopt.h"
 #include "zc_zmq.h"
 
@@ -9,7 +10,7 @@ int main(int argc, char* argv[])
 
     opterr = 0;
     while (1) {
-        int c = getopt(argc, argv, "hbcrw0vn:o:");
+        int c = getopt(argc, argv, "hbcrw0vpHUXn:m:t:d:f:s:l:B:z:x:T:R:C:e:j:g:G:F:K:Y:D:k:E:i:S:L:o:O:a:");
         if (c < 0) {
             break;
         }
@@ -43,21 +44,150 @@ int main(int argc, char* argv[])
             zc_zmq_set_verbose(1);
             break;
 
+        case 'p':
+            zc_zmq_set_pipeline(1);
+            break;
+
+        case 'H':
+            zc_zmq_set_huge(1);
+            break;
+
+        case 'U':
+            zc_zmq_set_unordered(1);
+            break;
+
+        case 'X':
+            zc_zmq_set_proxy(1);
+            break;
+
         case 'n':
             zc_zmq_set_iterations(atoi(optarg));
             break;
 
+        case 'm':
+            zc_zmq_set_max_record(atoi(optarg));
+            break;
+
+        case 't':
+            zc_zmq_set_flush(atoi(optarg));
+            break;
+
+        case 'd':
+            zc_zmq_set_drain(atoi(optarg));
+            break;
+
+        case 'f':
+            zc_zmq_set_file(optarg);
+            break;
+
+        case 's':
+            zc_zmq_set_segment(optarg);
+            break;
+
+        case 'l':
+            zc_zmq_set_framing(optarg);
+            break;
+
+        case 'B':
+            zc_zmq_set_batch(optarg);
+            break;
+
+        case 'z':
+            zc_zmq_set_compress(optarg);
+            break;
+
+        case 'x':
+            zc_zmq_set_bench(optarg);
+            break;
+
+        case 'T':
+            zc_zmq_set_trace(optarg);
+            break;
+
+        case 'R':
+            zc_zmq_set_window(atoi(optarg));
+            break;
+
+        case 'C':
+            zc_zmq_set_capture(optarg);
+            break;
+
+        case 'e':
+            zc_zmq_set_exec(optarg);
+            break;
+
+        case 'j':
+            zc_zmq_set_workers(atoi(optarg));
+            break;
+
+        case 'g':
+            zc_zmq_add_keep(optarg);
+            break;
+
+        case 'G':
+            zc_zmq_add_drop(optarg);
+            break;
+
+        case 'F':
+            zc_zmq_add_field(optarg);
+            break;
+
+        case 'K':
+            zc_zmq_set_journal(optarg);
+            break;
+
+        case 'Y':
+            zc_zmq_set_replay(optarg);
+            break;
+
+        case 'D':
+            zc_zmq_set_shards(optarg);
+            break;
+
+        case 'k':
+            zc_zmq_set_key(optarg);
+            break;
+
+        case 'E':
+            zc_zmq_set_route(optarg);
+            break;
+
+        case 'i':
+            zc_zmq_set_uring(optarg);
+            break;
+
+        case 'S':
+            zc_zmq_set_stats(atoi(optarg));
+            break;
+
+        case 'L':
+            zc_zmq_set_latency(atoi(optarg));
+            break;
+
         case 'o':
             zc_zmq_add_option(optarg);
             break;
 
+        case 'O':
+            zc_zmq_add_context_option(optarg);
+            break;
+
+        case 'a':
+            zc_zmq_add_affinity(optarg);
+            break;
+
         default:
             printf("Unknown option '%c'\n", optopt);
             break;
         }
     }
 
-    if ((argc - optind) < 2) {
+    if (optind < argc && strchr(argv[optind], ',') != 0) {
+        int j = optind;
+        while (j < argc) {
+            zc_zmq_add_socket(argv[j++]);
+        }
+    } else if ((argc - optind) < 2) {
         zc_zmq_show_usage();
     } else {
         int j = optind;
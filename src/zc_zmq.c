@@ -2,8 +2,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
 #include <zmq.h>
 #include "buffer.h"
+#include "reader.h"
+#include "writer.h"
+#include "queue.h"
+#include "mapfile.h"
+#include "segment.h"
+#include "frame.h"
+#include "compress.h"
+#include "bench.h"
+#include "stats.h"
+#include "histo.h"
+#include "trace.h"
+#include "affinity.h"
+#include "pool.h"
+#include "filter.h"
+#include "journal.h"
+#include "key.h"
+#include "shard.h"
+#include "ring.h"
+#include "uring.h"
 #include "zc_zmq.h"
 
 #define DEFAULT_PROGRAM_NAME "zc"
@@ -14,6 +40,8 @@
 #define SOCKET_TYPE_SUB   "SUB"
 #define SOCKET_TYPE_REQ   "REQ"
 #define SOCKET_TYPE_REP   "REP"
+#define SOCKET_TYPE_DEALER "DEALER"
+#define SOCKET_TYPE_ROUTER "ROUTER"
 
 #define SOCKET_OPTION_SUBSCRIBE   "SUBSCRIBE"
 #define SOCKET_OPTION_UNSUBSCRIBE "UNSUBSCRIBE"
@@ -27,6 +55,25 @@
 #define SOCKET_OPTION_LINGER      "LINGER"
 #define SOCKET_OPTION_BACKLOG     "BACKLOG"
 #define SOCKET_OPTION_IPV4ONLY    "IPV4ONLY"
+#define SOCKET_OPTION_AFFINITY    "AFFINITY"
+#define SOCKET_OPTION_TOS         "TOS"
+#define SOCKET_OPTION_IMMEDIATE   "IMMEDIATE"
+#define SOCKET_OPTION_TCP_KEEPALIVE       "TCP_KEEPALIVE"
+#define SOCKET_OPTION_TCP_KEEPALIVE_CNT   "TCP_KEEPALIVE_CNT"
+#define SOCKET_OPTION_TCP_KEEPALIVE_IDLE  "TCP_KEEPALIVE_IDLE"
+#define SOCKET_OPTION_TCP_KEEPALIVE_INTVL "TCP_KEEPALIVE_INTVL"
+
+#define CONTEXT_OPTION_IO_THREADS          "IO_THREADS"
+#define CONTEXT_OPTION_MAX_SOCKETS         "MAX_SOCKETS"
+#define CONTEXT_OPTION_MAX_MSGSZ           "MAX_MSGSZ"
+#define CONTEXT_OPTION_THREAD_PRIORITY     "THREAD_PRIORITY"
+#define CONTEXT_OPTION_THREAD_SCHED_POLICY "THREAD_SCHED_POLICY"
+#define CONTEXT_OPTION_THREAD_CPUS         "THREAD_CPUS"
+
+#define OPT_INT    0
+#define OPT_STRING 1
+#define OPT_UINT64 2
+#define OPT_CPUS   3
 
 #define DELIMITER_NEWLINE '\n'
 #define DELIMITER_NULL    '\0'
@@ -34,8 +81,28 @@
 #define OPT_SEPARATOR '='
 
 #define MAX_STR 1024
+#define MAX_RECORD (16 * 1024 * 1024)
+#define MAX_OUTPUT (64 * 1024)
+#define FLUSH_MSEC 50
+#define DRAIN_MAX 256
+#define PIPELINE_DEPTH 1024
+#define SEND_POLL_MSEC 100
+#define MAX_INLINE 32
+#define BATCH_BYTES (64 * 1024)
+#define BATCH_USEC 1000
+#define BENCH_IDLE_MSEC 2000
+#define BENCH_SETTLE_MSEC 200
+#define STAMP_SIZE 8
+#define REQUEST_ID_SIZE 8
+#define MAX_ENVELOPE 8
 #define MAX_OPT 50
 #define MAX_ADD 50
+#define MAX_SOCK 16
+#define WORKER_ENDPOINT "inproc://zc-workers"
+#define WORKER_QUEUE 1024
+#define WORKER_POLL_MSEC 100
+#define ROUTE_HASH  1
+#define ROUTE_SPILL 2
 
 #if ZMQ_VERSION < ZMQ_MAKE_VERSION(3, 0, 0)
 
@@ -48,6 +115,13 @@
 #define ZMQ_RCVHWM -1
 #define ZMQ_IPV4ONLY -2
 
+#define ZMQ_DONTWAIT ZMQ_NOBLOCK
+#define ZMQ_MORE_T int64_t
+
+#ifndef ZMQ_POLL_MSEC
+#define ZMQ_POLL_MSEC 1000
+#endif
+
 #else
 
 #define ZMQ_INIT zmq_ctx_new()
@@ -55,18 +129,99 @@
 #define ZMQ_SEND(s, m, f) zmq_sendmsg(s, m, f)
 #define ZMQ_RECV(s, m, f) zmq_recvmsg(s, m, f)
 
+#define ZMQ_MORE_T int
+
 #endif
 
 typedef struct SockAdd {
     char ep[MAX_STR];
+    int sock;
 } SockAdd;
 
 typedef struct SockOpt {
     char name[MAX_STR];
     int id;
+    int kind;
     char value[MAX_STR];
+    int sock;
 } SockOpt;
 
+typedef struct OptInfo {
+    const char* name;
+    int id;
+    int kind;
+} OptInfo;
+
+static const OptInfo socket_options[] = {
+    { SOCKET_OPTION_SUBSCRIBE,   ZMQ_SUBSCRIBE,   OPT_STRING },
+    { SOCKET_OPTION_UNSUBSCRIBE, ZMQ_UNSUBSCRIBE, OPT_STRING },
+    { SOCKET_OPTION_IDENTITY,    ZMQ_IDENTITY,    OPT_STRING },
+    { SOCKET_OPTION_SNDHWM,      ZMQ_SNDHWM,      OPT_INT    },
+    { SOCKET_OPTION_RCVHWM,      ZMQ_RCVHWM,      OPT_INT    },
+    { SOCKET_OPTION_SNDBUF,      ZMQ_SNDBUF,      OPT_INT    },
+    { SOCKET_OPTION_RCVBUF,      ZMQ_RCVBUF,      OPT_INT    },
+    { SOCKET_OPTION_SNDTIMEO,    ZMQ_SNDTIMEO,    OPT_INT    },
+    { SOCKET_OPTION_RCVTIMEO,    ZMQ_RCVTIMEO,    OPT_INT    },
+    { SOCKET_OPTION_LINGER,      ZMQ_LINGER,      OPT_INT    },
+    { SOCKET_OPTION_BACKLOG,     ZMQ_BACKLOG,     OPT_INT    },
+    { SOCKET_OPTION_IPV4ONLY,    ZMQ_IPV4ONLY,    OPT_INT    },
+    { SOCKET_OPTION_AFFINITY,    ZMQ_AFFINITY,    OPT_UINT64 },
+#ifdef ZMQ_TOS
+    { SOCKET_OPTION_TOS,         ZMQ_TOS,         OPT_INT    },
+#endif
+#ifdef ZMQ_IMMEDIATE
+    { SOCKET_OPTION_IMMEDIATE,   ZMQ_IMMEDIATE,   OPT_INT    },
+#endif
+#ifdef ZMQ_TCP_KEEPALIVE
+    { SOCKET_OPTION_TCP_KEEPALIVE,       ZMQ_TCP_KEEPALIVE,       OPT_INT },
+    { SOCKET_OPTION_TCP_KEEPALIVE_CNT,   ZMQ_TCP_KEEPALIVE_CNT,   OPT_INT },
+    { SOCKET_OPTION_TCP_KEEPALIVE_IDLE,  ZMQ_TCP_KEEPALIVE_IDLE,  OPT_INT },
+    { SOCKET_OPTION_TCP_KEEPALIVE_INTVL, ZMQ_TCP_KEEPALIVE_INTVL, OPT_INT },
+#endif
+    { 0, 0, 0 },
+};
+
+static const OptInfo context_options[] = {
+#ifdef ZMQ_IO_THREADS
+    { CONTEXT_OPTION_IO_THREADS,  ZMQ_IO_THREADS,  OPT_INT },
+    { CONTEXT_OPTION_MAX_SOCKETS, ZMQ_MAX_SOCKETS, OPT_INT },
+#endif
+#ifdef ZMQ_MAX_MSGSZ
+    { CONTEXT_OPTION_MAX_MSGSZ,           ZMQ_MAX_MSGSZ,           OPT_INT },
+#endif
+#ifdef ZMQ_THREAD_PRIORITY
+    { CONTEXT_OPTION_THREAD_PRIORITY,     ZMQ_THREAD_PRIORITY,     OPT_INT },
+    { CONTEXT_OPTION_THREAD_SCHED_POLICY, ZMQ_THREAD_SCHED_POLICY, OPT_INT },
+#endif
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+    { CONTEXT_OPTION_THREAD_CPUS, ZMQ_THREAD_AFFINITY_CPU_ADD, OPT_CPUS },
+#endif
+    { 0, 0, 0 },
+};
+
+typedef struct Sock {
+    char type[MAX_STR];
+    int stype;
+    int bind;
+    void* sock;
+} Sock;
+
+typedef struct Request {
+    unsigned seq;
+    int state;
+    long sent;
+    zmq_msg_t reply;
+} Request;
+
+#define REQUEST_FREE    0
+#define REQUEST_WAITING 1
+#define REQUEST_DONE    2
+
+typedef struct Envelope {
+    int n;
+    zmq_msg_t part[MAX_ENVELOPE];
+} Envelope;
+
 static char prog_[MAX_STR];
 static int verbose_;
 static int bind_;
@@ -76,6 +231,36 @@ static int write_;
 static char type_[MAX_STR];
 static char delimiter_;
 static int iterations_;
+static int max_record_;
+static int huge_;
+static int flush_;
+static int drain_;
+static int pipeline_;
+static char file_[MAX_STR];
+static char segment_[MAX_STR];
+static int framing_;
+static char compress_[MAX_STR];
+static char bench_[MAX_STR];
+static char trace_[MAX_STR];
+static int proxy_;
+static int window_;
+static int unordered_;
+static char capture_[MAX_STR];
+static char exec_[MAX_STR];
+static char journal_[MAX_STR];
+static char replay_[MAX_STR];
+static char shards_[MAX_STR];
+static char key_[MAX_STR];
+static int route_;
+static int uring_depth_;
+static int uring_size_;
+static int workers_;
+static int stats_;
+static int latency_;
+static int latency_msec_;
+static int batch_records_;
+static int batch_bytes_;
+static int batch_usec_;
 
 static int nadd;
 static SockAdd sadd[MAX_ADD];
@@ -83,33 +268,154 @@ static SockAdd sadd[MAX_ADD];
 static int nopt;
 static SockOpt sopt[MAX_OPT];
 
+static int ncopt;
+static SockOpt copt[MAX_OPT];
+
+static int nsock;
+static Sock ssock[MAX_SOCK];
+static int next_sock_;
+static int capture_sock_ = -1;
+static int capture_fd_ = -1;
+static Request* req_;
+static int* req_free_;
+static int req_nfree_;
+static int* req_order_;
+static unsigned req_next_;
+static unsigned req_out_;
+static int req_eof_;
+static Envelope* env_;
+static unsigned env_put_;
+static unsigned env_take_;
+static void* backend_;
+static pthread_t worker_[POOL_MAX_WORKERS];
+static int nworker_;
+static zmq_msg_t ready_[POOL_MAX_WORKERS];
+static unsigned ready_put_;
+static unsigned ready_take_;
+
 static void* ctxt_;
 static void* sock_;
 static int stype_;
-static int goon_;
+static volatile sig_atomic_t goon_;
+static volatile sig_atomic_t interrupted_;
+static volatile sig_atomic_t reader_running_;
+static Histo* latency_all_;
+static Histo* latency_now_;
+static long latency_next_;
+static Queue* queue_;
+static Uring* input_;
+static Uring* output_;
+static pthread_t reader_;
+static char* batch_;
+static int batch_used_;
+static int batch_count_;
+static long batch_start_;
+static int batch_left_ = -1;    // records -n still lets through, or -1
+
+typedef struct BenchPeer {
+    void* sock;
+    long msgs;
+    long bytes;
+    Histo* latency;
+} BenchPeer;
 
 static int zc_zmq_is_valid(void);
-static void zc_zmq_do_read(void);
+static void zc_zmq_loop(void);
+static void zc_zmq_bench(int steps);
+static void* zc_zmq_bench_thread(void* arg);
+static void zc_zmq_start_pipeline(void);
+static void zc_zmq_stop_pipeline(void);
+static int zc_zmq_do_read(int max);
+static int zc_zmq_do_poll(int max);
+static int zc_zmq_drain(void* sock, int max);
+static int zc_zmq_take(void* sock, zmq_msg_t* msg, int n);
+static int zc_zmq_capture(void* sock, zmq_msg_t* msg, int n);
+static void zc_zmq_do_replay(void);
+static int zc_zmq_output(const char* data, int len);
+static int zc_zmq_pending(void);
+static int zc_zmq_flush(void);
+static int zc_zmq_uring_sink(const struct iovec* iov, int n, int sync);
 static void zc_zmq_do_write(void);
+static void zc_zmq_do_batch(void);
+static void zc_zmq_send_batch(void);
+static int zc_zmq_put_batch(const char* data, int len);
+static void zc_zmq_send_data(char* data, int p, zmq_free_fn* ffn);
+static void zc_zmq_send_compressed(int wait);
+static void zc_zmq_send_msg(char* data, int p, zmq_free_fn* ffn);
+static int zc_zmq_send_stamped(void* sock, zmq_msg_t* msg, int wait);
+static int zc_zmq_send_routed(zmq_msg_t* msg, const char* data, int p);
+static int zc_zmq_send_frame(void* sock, zmq_msg_t* msg, int flags);
+static int zc_zmq_send_wait(void* sock, zmq_msg_t* msg, int flags);
+static long zc_zmq_now_nsec(void);
+static int zc_zmq_more(void* sock);
+static void zc_zmq_stamp(zmq_msg_t* msg, int n);
+static void zc_zmq_add_latency(long sent, long now);
+static int zc_zmq_is_request(void);
+static int zc_zmq_window_start(void);
+static void zc_zmq_window_stop(void);
+static int zc_zmq_do_dealer(void);
+static void zc_zmq_send_request(void);
+static int zc_zmq_take_reply(void);
+static int zc_zmq_do_router(void);
+static int zc_zmq_take_request(void);
+static void zc_zmq_send_reply(void);
+static int zc_zmq_workers_start(void);
+static void zc_zmq_workers_stop(void);
+static void* zc_zmq_worker_thread(void* arg);
+static int zc_zmq_do_pool(void);
+static int zc_zmq_take_worker(void);
+static int zc_zmq_queue_request(void);
+static void zc_zmq_dispatch(void);
+static int zc_zmq_recv_parts(void* sock, zmq_msg_t* part, int max, int flags);
+static int zc_zmq_wait(int sock, int input);
+static int zc_zmq_next_input(char** data, zmq_free_fn** ffn);
+static int zc_zmq_input_ready(int usec);
+static void zc_zmq_proxy(void);
+static int zc_zmq_forward(void* from, const int* back, int nback);
+static void zc_zmq_discard(void* sock, int more);
+static void zc_zmq_signal(int sig);
+static void* zc_zmq_reader_thread(void* arg);
 static const char* zc_zmq_get_delimiter(char d, char* buf);
-static int zc_zmq_set_options(void);
+static void zc_zmq_show_options(const OptInfo* table);
+static int zc_zmq_socket_type(const char* type);
+static int zc_zmq_parse_option(const char* opt, const OptInfo* table,
+                               SockOpt* so, int count);
+static void zc_zmq_set_context(void);
+static int zc_zmq_set_options(void* sock, int idx);
+static int zc_zmq_split_socket(void);
+static void zc_zmq_route_init(void);
 
 void zc_zmq_init(const char* s)
 {
     strcpy(prog_, s);
     delimiter_ = DELIMITER_NEWLINE;
+    max_record_ = MAX_RECORD;
+    flush_ = FLUSH_MSEC;
+    drain_ = DRAIN_MAX;
     stype_ = -1;
     goon_ = 1;
 }
 
 void zc_zmq_cleanup(void)
 {
-    if (sock_ != 0) {
-        zmq_close(sock_);
-        sock_ = 0;
+    int j;
+
+    zc_zmq_stop_pipeline();
+    zc_zmq_workers_stop();
+    if (batch_ != 0) {
+        buffer_free(batch_);
+        batch_ = 0;
+        batch_used_ = batch_count_ = 0;
+    }
+    for (j = 0; j < nsock; ++j) {
+        if (ssock[j].sock == 0)
+            continue;
+        zmq_close(ssock[j].sock);
+        ssock[j].sock = 0;
         if (verbose_)
-            fprintf(stderr, "Closed socket\n");
+            fprintf(stderr, "Closed socket #%d\n", j);
     }
+    sock_ = 0;
     if (ctxt_ != 0) {
         ZMQ_TERM(ctxt_);
         ctxt_ = 0;
@@ -117,12 +423,59 @@ void zc_zmq_cleanup(void)
             fprintf(stderr, "Destroyed context\n");
     }
 
+    reader_clean();
+    uring_destroy(input_);
+    input_ = 0;
+    mapfile_clean();
+    journal_clean();
+    shard_clean();
+    writer_clean();
+    uring_destroy(output_);
+    output_ = 0;
+    if (capture_fd_ > STDOUT_FILENO) {
+        close(capture_fd_);
+        capture_fd_ = -1;
+    }
+    segment_clean();
+    stats_clean();
+    pool_clean();
+    if (latency_all_ != 0) {
+        histo_print(latency_all_, "latency at exit");
+        histo_destroy(latency_all_);
+        histo_destroy(latency_now_);
+        latency_all_ = latency_now_ = 0;
+    }
+    compress_clean();
+    bench_clean();
+    filter_clean();
+    ring_clean();
+    trace_clean();
     buffer_clean();
 }
 
+static void zc_zmq_show_options(const OptInfo* table)
+{
+    int col = 0;
+    int j;
+
+    for (j = 0; table[j].name != 0; ++j) {
+        int len = strlen(table[j].name);
+        if (table[j].id < 0)
+            continue;
+        if (col > 0 && col + len > 70) {
+            printf("\n");
+            col = 0;
+        }
+        printf("%s%s", col == 0 ? "      " : " ", table[j].name);
+        col += len + 1;
+    }
+    if (col > 0)
+        printf("\n");
+}
+
 void zc_zmq_show_usage(void)
 {
-    printf("Usage: %s [-hv0rwbc] [-n num] [-o opt=val] TYPE address ...\n",
+    printf("Usage: %s [-hv0rwbcpHUX] [-n num] [-m size] [-t msec] [-d num] [-f file] [-s spec] [-l framing] [-B spec] [-z spec] [-x spec] [-T spec] [-R num] [-C capture] [-e cmd] [-j num] [-g pattern] [-G pattern] [-F field=value] [-K journal] [-Y spec] [-D shards] [-k key] [-E mode] [-i depth] [-S msec] [-L msec] [-o opt=val] [-O opt=val] [-a role=cpus] TYPE address ... | SPEC ...\n",
            prog_[0] ? prog_ : DEFAULT_PROGRAM_NAME);
     printf("  -h: show this help\n");
     printf("  -v: verbose output; default is quiet\n");
@@ -132,32 +485,95 @@ void zc_zmq_show_usage(void)
     printf("  -b: bind socket to address(es)\n");
     printf("  -c: connect socket to address(es)\n");
     printf("  -n: read / write at most num records; default is infinite\n");
-    printf("  -o: set socket option to given value\n"
-           "      %s %s %s %s %s\n"
-           "      %s %s %s %s %s %s %s\n",
-           SOCKET_OPTION_SUBSCRIBE,
-           SOCKET_OPTION_UNSUBSCRIBE,
-           SOCKET_OPTION_IDENTITY,
-           SOCKET_OPTION_SNDHWM,
-           SOCKET_OPTION_RCVHWM,
-           SOCKET_OPTION_SNDBUF,
-           SOCKET_OPTION_RCVBUF,
-           SOCKET_OPTION_SNDTIMEO,
-           SOCKET_OPTION_RCVTIMEO,
-           SOCKET_OPTION_LINGER,
-           SOCKET_OPTION_BACKLOG,
-           SOCKET_OPTION_IPV4ONLY);
+    printf("  -m: drop records longer than size bytes; default is %d\n",
+           MAX_RECORD);
+    printf("  -t: flush output after msec without messages; default is %d\n",
+           FLUSH_MSEC);
+    printf("  -d: drain at most num messages per wakeup; default is %d\n",
+           DRAIN_MAX);
+    printf("  -p: read stdin on a separate thread while writing\n");
+    printf("  -f: write records from file instead of stdin, without copying\n");
+    printf("  -s: write output to rotating segment files instead of stdout\n"
+           "      path[,size=bytes][,time=secs][,chunk=bytes][,direct]\n");
+    printf("  -l: use length prefixes instead of delimiters for reading / writing\n"
+           "      varint u32\n");
+    printf("  -B: pack records into batch messages when writing, unpack when reading\n"
+           "      records[,bytes[,usec]]; defaults are %d bytes, %d usec\n",
+           BATCH_BYTES, BATCH_USEC);
+    printf("  -z: compress messages when writing, expand them when reading\n"
+           "      codec[,level=N][,min=bytes][,threads=N]; codec is lz4 or zstd\n");
+    printf("  -x: benchmark a PUSH / PUB socket against a peer in this process\n"
+           "      [count=N][,size=bytes|min-max][,dist=fixed|uniform|exp][,sweep=min-max]\n");
+    printf("  -T: trace events to stderr through per-thread rings\n"
+           "      level[,sample=N]; level 1 errors, 2 batches, 3 messages\n");
+    printf("  -R: with %s / %s, keep up to num requests outstanding; default is 1\n"
+           "      %s reports round-trip latency, like -L\n",
+           SOCKET_TYPE_DEALER, SOCKET_TYPE_ROUTER, SOCKET_TYPE_DEALER);
+    printf("  -U: with -R, write out replies as they arrive instead of in order\n");
+    printf("  -X: forward messages from the %s / %s sockets to all the %s / %s\n"
+           "      ones, keeping multipart frames; SIGUSR2 pauses and resumes\n",
+           SOCKET_TYPE_PULL, SOCKET_TYPE_SUB, SOCKET_TYPE_PUSH, SOCKET_TYPE_PUB);
+    printf("  -C: with -X, copy every frame to a file ('-' for stdout) or to a\n"
+           "      %s / %s socket given as a SPEC\n",
+           SOCKET_TYPE_PUSH, SOCKET_TYPE_PUB);
+    printf("  -e: with %s, answer requests with a pool of coprocesses running\n"
+           "      sh -c cmd, each reading one record and writing (and flushing)\n"
+           "      one reply; requests holding the delimiter get an empty reply;\n"
+           "      -R bounds the requests queued for an idle worker, default %d\n",
+           SOCKET_TYPE_ROUTER, WORKER_QUEUE);
+    printf("  -j: with -e, run num workers; default is one per CPU\n");
+    printf("  -g: when reading, keep only records containing pattern; give it\n"
+           "      more than once to keep records containing any of them\n");
+    printf("  -G: when reading, drop records containing pattern\n");
+    printf("  -F: when reading, keep only records whose field number is value;\n"
+           "      fields are separated by blanks, and all of these must match\n");
+    printf("  -K: write every message read, with its frames and receive time,\n"
+           "      to a journal file (and a sparse time index in journal.idx)\n");
+    printf("  -Y: send the messages in a journal, as fast as possible or at\n"
+           "      the original pace divided by speed, optionally starting secs in\n"
+           "      journal[,speed=factor][,seek=secs]\n");
+    printf("  -D: split records read across shards by a hash of their key, each\n"
+           "      written by its own thread; N files, numbered where path has %%d,\n"
+           "      or N copies of a command, each with $SHARD set\n"
+           "      N:path | N:|cmd\n");
+    printf("  -k: with -D or -E, the key to hash; default is the whole record\n"
+           "      field=N | bytes=A-B\n");
+    printf("  -E: with several %s / %s endpoints, give each its own socket and\n"
+           "      send every record to just one, by consistent hashing of its\n"
+           "      key; with spill, records for an endpoint at its HWM go on to\n"
+           "      the next one round the ring\n"
+           "      hash | spill\n",
+           SOCKET_TYPE_PUSH, SOCKET_TYPE_PUB);
+    printf("  -i: read stdin and write stdout through io_uring, keeping up to\n"
+           "      depth buffers in flight; default is %d buffers of %d bytes\n"
+           "      depth[,bytes]\n",
+           URING_DEPTH, URING_SIZE);
+    printf("  -S: print statistics to stderr every msec, and on SIGUSR1\n");
+    printf("  -L: send a timestamp frame with every message; when reading, strip\n"
+           "      it and report latency every msec (0 for only at exit)\n");
+    printf("  -H: back large buffers with huge pages\n");
+    printf("  -o: set socket option to given value\n");
+    zc_zmq_show_options(socket_options);
+    printf("  -O: set context option to given value; THREAD_CPUS takes a list\n");
+    zc_zmq_show_options(context_options);
+    printf("  -a: pin zc's own threads to CPUs, like main=0-3,8\n"
+           "      main reader compress worker\n");
     printf("  TYPE: socket type\n"
-           "        %s %s %s %s %s %s\n",
+           "        %s %s %s %s %s %s %s %s\n",
            SOCKET_TYPE_PUSH,
            SOCKET_TYPE_PULL,
            SOCKET_TYPE_PUB,
            SOCKET_TYPE_SUB,
            SOCKET_TYPE_REQ,
-           SOCKET_TYPE_REP);
+           SOCKET_TYPE_REP,
+           SOCKET_TYPE_DEALER,
+           SOCKET_TYPE_ROUTER);
 
     printf("  address: one or more addresses in ZMQ format\n"
            "           ('tcp://127.0.0.1:5000', 'inproc://pipe')\n");
+    printf("  SPEC: one or more sockets, each with its own type, mode and options,\n"
+           "        all read into stdout or all written from stdin\n"
+           "        TYPE[,bind|connect][,OPTION=value...],address...\n");
 }
 
 void zc_zmq_set_verbose(int v)
@@ -205,25 +621,61 @@ void zc_zmq_set_type(const char* type)
 {
     strcpy(type_, type);
 
-    stype_ = -1;
-    if (strcmp(type_, SOCKET_TYPE_PUSH) == 0) {
-        stype_ = ZMQ_PUSH;
-    } else if (strcmp(type_, SOCKET_TYPE_PULL) == 0) {
-        stype_ = ZMQ_PULL;
-    } else if (strcmp(type_, SOCKET_TYPE_PUB) == 0) {
-        stype_ = ZMQ_PUB;
-    } else if (strcmp(type_, SOCKET_TYPE_SUB) == 0) {
-        stype_ = ZMQ_SUB;
-    } else if (strcmp(type_, SOCKET_TYPE_REQ) == 0) {
-        stype_ = ZMQ_REQ;
-    } else if (strcmp(type_, SOCKET_TYPE_REP) == 0) {
-        stype_ = ZMQ_REP;
-    } else {
+    stype_ = zc_zmq_socket_type(type_);
+    if (stype_ < 0) {
         if (verbose_)
             fprintf(stderr, "Unknown socket type [%s]\n", type_);
     }
 }
 
+void zc_zmq_add_socket(const char* spec)
+{
+    char buf[MAX_STR];
+    char* p = 0;
+    char* save = 0;
+    Sock* s = 0;
+
+    if (nsock >= MAX_SOCK) {
+        printf("Too many sockets (max is %d): [%s]\n",
+               MAX_SOCK, spec);
+        return;
+    }
+    s = &ssock[nsock];
+
+    strcpy(buf, spec);
+    p = strtok_r(buf, ",", &save);
+    if (p == 0 || zc_zmq_socket_type(p) < 0) {
+        printf("Invalid socket type in [%s]\n", spec);
+        return;
+    }
+    strcpy(s->type, p);
+    s->stype = zc_zmq_socket_type(p);
+    s->bind = -1;
+
+    // Addresses and options added here belong to socket #nsock.
+    while ((p = strtok_r(0, ",", &save)) != 0) {
+        char* q = strchr(p, OPT_SEPARATOR);
+        if (strcmp(p, "bind") == 0) {
+            s->bind = 1;
+        } else if (strcmp(p, "connect") == 0) {
+            s->bind = 0;
+        } else if (q != 0 &&
+                   strspn(p, "ABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789") ==
+                   (size_t) (q - p)) {
+            int n = nopt;
+            zc_zmq_add_option(p);
+            if (nopt > n)
+                sopt[n].sock = nsock;
+        } else {
+            zc_zmq_add_address(p);
+        }
+    }
+
+    if (nsock == 0)
+        zc_zmq_set_type(s->type);
+    ++nsock;
+}
+
 void zc_zmq_add_address(const char* address)
 {
     if (nadd >= MAX_ADD) {
@@ -233,6 +685,7 @@ void zc_zmq_add_address(const char* address)
     }
 
     strcpy(sadd[nadd].ep, address);
+    sadd[nadd].sock = nsock;
     ++nadd;
 }
 
@@ -246,321 +699,2461 @@ void zc_zmq_set_iterations(int n)
     iterations_ = n;
 }
 
-void zc_zmq_add_option(const char* opt)
+void zc_zmq_set_max_record(int m)
 {
-    char buf[MAX_STR];
-    char* p = 0;
-    char* q = 0;
-
-    if (nopt >= MAX_OPT) {
-        printf("Too many options (max is %d): [%s]\n",
-               MAX_OPT, opt);
-        return;
-    }
-
-    strcpy(buf, opt);
-    for (p = buf, q = 0; *p != '\0'; ++p) {
-        if (*p == OPT_SEPARATOR) {
-            *p = '\0';
-            q = p+1;
-            break;
-        }
-    }
-
-    if (q == 0) {
-        printf("Invalid option without a valid separator '%c'\n",
-               OPT_SEPARATOR);
+    if (m <= 0) {
+        printf("Invalid max record size %d\n", m);
         return;
     }
+    max_record_ = m;
+}
 
-    int ok = 1;
-    if (strcmp(buf, SOCKET_OPTION_SUBSCRIBE) == 0) {
-        sopt[nopt].id = ZMQ_SUBSCRIBE;
-    } else if (strcmp(buf, SOCKET_OPTION_UNSUBSCRIBE) == 0) {
-        sopt[nopt].id = ZMQ_UNSUBSCRIBE;
-    } else if (strcmp(buf, SOCKET_OPTION_IDENTITY) == 0) {
-        sopt[nopt].id = ZMQ_IDENTITY;
-    } else if (strcmp(buf, SOCKET_OPTION_SNDHWM) == 0) {
-        sopt[nopt].id = ZMQ_SNDHWM;
-    } else if (strcmp(buf, SOCKET_OPTION_RCVHWM) == 0) {
-        sopt[nopt].id = ZMQ_RCVHWM;
-    } else if (strcmp(buf, SOCKET_OPTION_SNDBUF) == 0) {
-        sopt[nopt].id = ZMQ_SNDBUF;
-    } else if (strcmp(buf, SOCKET_OPTION_RCVBUF) == 0) {
-        sopt[nopt].id = ZMQ_RCVBUF;
-    } else if (strcmp(buf, SOCKET_OPTION_SNDTIMEO) == 0) {
-        sopt[nopt].id = ZMQ_SNDTIMEO;
-    } else if (strcmp(buf, SOCKET_OPTION_RCVTIMEO) == 0) {
-        sopt[nopt].id = ZMQ_RCVTIMEO;
-    } else if (strcmp(buf, SOCKET_OPTION_LINGER) == 0) {
-        sopt[nopt].id = ZMQ_LINGER;
-    } else if (strcmp(buf, SOCKET_OPTION_BACKLOG) == 0) {
-        sopt[nopt].id = ZMQ_BACKLOG;
-    } else if (strcmp(buf, SOCKET_OPTION_IPV4ONLY) == 0) {
-        if (ZMQ_IPV4ONLY < 0)
-            ok = 0;
-        else
-            sopt[nopt].id = ZMQ_IPV4ONLY;
-    } else {
-        ok = 0;
-    }
+void zc_zmq_set_flush(int msec)
+{
+    flush_ = msec;
+}
 
-    if (!ok) {
-        printf("Invalid socket option [%s]\n", buf);
-        return;
-    }
+void zc_zmq_set_drain(int n)
+{
+    drain_ = n > 0 ? n : 1;
+}
 
-    strcpy(sopt[nopt].name, buf);
-    strcpy(sopt[nopt].value, q);
-    ++nopt;
+void zc_zmq_set_pipeline(int p)
+{
+    pipeline_ = p;
 }
 
-void zc_zmq_run(void)
+void zc_zmq_set_file(const char* name)
 {
-    int count = 0;
-    int subs = 0;
-    int j;
+    strcpy(file_, name);
+}
 
-    if (! zc_zmq_is_valid())
-        return;
+void zc_zmq_set_segment(const char* spec)
+{
+    strcpy(segment_, spec);
+}
 
-    if (verbose_)
-        fprintf(stderr, "------\n");
+void zc_zmq_set_framing(const char* framing)
+{
+    if (strcmp(framing, "varint") == 0) {
+        framing_ = FRAME_VARINT;
+    } else if (strcmp(framing, "u32") == 0) {
+        framing_ = FRAME_U32;
+    } else {
+        printf("Invalid framing [%s]\n", framing);
+    }
+}
 
-    buffer_init(verbose_);
+void zc_zmq_set_batch(const char* spec)
+{
+    char* p = 0;
 
-    ctxt_ = ZMQ_INIT;
-    if (verbose_)
-        fprintf(stderr, "Context created: %p\n", ctxt_);
+    batch_records_ = (int) strtol(spec, &p, 10);
+    batch_bytes_ = BATCH_BYTES;
+    batch_usec_ = BATCH_USEC;
+    if (*p == ',') {
+        batch_bytes_ = (int) strtol(p + 1, &p, 10);
+        if (*p == ',')
+            batch_usec_ = (int) strtol(p + 1, &p, 10);
+    }
 
-    sock_ = zmq_socket(ctxt_, stype_);
-    if (verbose_)
-        fprintf(stderr, "Socket type %s (%d) created: %p\n",
-                type_, stype_, sock_);
+    if (batch_records_ < 1)
+        batch_records_ = 1;
+    if (batch_bytes_ < 1)
+        batch_bytes_ = BATCH_BYTES;
+    if (batch_usec_ < 0)
+        batch_usec_ = 0;
+}
 
-    subs = zc_zmq_set_options();
+void zc_zmq_set_compress(const char* spec)
+{
+    strcpy(compress_, spec);
+}
 
-    if (stype_ == ZMQ_SUB && !subs) {
-        int ret = zmq_setsockopt(sock_, ZMQ_SUBSCRIBE, 0, 0);
-        if (verbose_)
-            fprintf(stderr, "Socket automatically subscribed to all messages: %d\n",
-                    ret);
-    }
+void zc_zmq_set_bench(const char* spec)
+{
+    strcpy(bench_, spec);
+}
 
-    for (j = 0; j < nadd; ++j) {
-        if (bind_) {
-            int ret = zmq_bind(sock_, sadd[j].ep);
-            if (verbose_) {
-                fprintf(stderr, "Socket bound to [%s]: %d", sadd[j].ep, ret);
-                if (ret < 0)
-                    fprintf(stderr, " (%d)", errno);
-                fprintf(stderr, "\n");
-            }
-            continue;
-        }
-        if (connect_) {
-            int ret = zmq_connect(sock_, sadd[j].ep);
-            if (verbose_) {
-                fprintf(stderr, "Socket connected to [%s]: %d", sadd[j].ep, ret);
-                if (ret < 0)
-                    fprintf(stderr, " (%d)", errno);
-                fprintf(stderr, "\n");
-            }
-            continue;
-        }
-    }
+void zc_zmq_set_window(int n)
+{
+    window_ = n > 0 ? n : 1;
+}
 
-    if (verbose_) {
-        fprintf(stderr, "Running loop...\n");
-        fprintf(stderr, "------\n");
-    }
+void zc_zmq_set_unordered(int u)
+{
+    unordered_ = u;
+}
 
-    count = 0;
-    goon_ = 1;
-    while (goon_) {
-        ++count;
-        if (iterations_ > 0 &&
-            count > iterations_) {
-            if (verbose_)
-                fprintf(stderr, "Reached %d iterations, aborting\n", iterations_);
-            break;
-        }
-        if (stype_ == ZMQ_REQ) {
-            zc_zmq_do_write();
-            zc_zmq_do_read();
-        } else if (stype_ == ZMQ_REP) {
-            zc_zmq_do_read();
-            zc_zmq_do_write();
-        } else if (read_) {
-            zc_zmq_do_read();
-        } else if (write_) {
-            zc_zmq_do_write();
-        } else {
-            if (verbose_)
-                fprintf(stderr, "Invalid loop mode\n");
-            break;
-        }
-    }
+void zc_zmq_set_proxy(int p)
+{
+    proxy_ = p;
+}
 
-    zc_zmq_cleanup();
+void zc_zmq_set_capture(const char* spec)
+{
+    strcpy(capture_, spec);
 }
 
-void zc_zmq_debug(void)
+void zc_zmq_set_exec(const char* cmd)
 {
-    int major = 0;
-    int minor = 0;
-    int patch = 0;
-    char buf[10];
-    int j;
+    strcpy(exec_, cmd);
+}
 
-    if (! verbose_)
-        return;
+void zc_zmq_set_workers(int n)
+{
+    workers_ = n;
+}
 
-    if (! zc_zmq_is_valid())
-        return;
+void zc_zmq_set_journal(const char* path)
+{
+    strcpy(journal_, path);
+}
 
-    zmq_version(&major, &minor, &patch);
-    fprintf(stderr, "ZQM version used: %d.%d.%d\n", major, minor, patch);
+void zc_zmq_set_replay(const char* spec)
+{
+    strcpy(replay_, spec);
+}
 
-    fprintf(stderr, "       will bind: %d\n", bind_);
-    fprintf(stderr, "    will connect: %d\n", connect_);
-    fprintf(stderr, "       will read: %d\n", read_);
-    fprintf(stderr, "      will write: %d\n", write_);
-    fprintf(stderr, "     socket type: %s (%d)\n", type_, stype_);
-    fprintf(stderr, "       delimiter: %s (%d)\n",
-            zc_zmq_get_delimiter(delimiter_, buf),
-            (int) delimiter_);
-    fprintf(stderr, "      iterations: %d\n", iterations_);
+void zc_zmq_set_shards(const char* spec)
+{
+    strcpy(shards_, spec);
+}
 
-    for (j = 0; j < nadd; ++j) {
-        fprintf(stderr, "     address #%2d: %s\n",
-                j, sadd[j].ep);
-    }
+void zc_zmq_set_key(const char* spec)
+{
+    strcpy(key_, spec);
+}
 
-    for (j = 0; j < nopt; ++j) {
-        fprintf(stderr, "      option #%2d: %s (%d) = [%s]\n",
-                j, sopt[j].name, sopt[j].id, sopt[j].value);
+void zc_zmq_set_route(const char* mode)
+{
+    if (strcmp(mode, "hash") == 0) {
+        route_ = ROUTE_HASH;
+    } else if (strcmp(mode, "spill") == 0) {
+        route_ = ROUTE_SPILL;
+    } else {
+        printf("Invalid routing mode [%s]\n", mode);
     }
 }
 
-static int zc_zmq_is_valid(void)
+void zc_zmq_set_uring(const char* spec)
 {
-    if (stype_ < 0)
-        return 0;
+    char* p = 0;
 
-    if (nadd <= 0)
-        return 0;
+    uring_depth_ = (int) strtol(spec, &p, 10);
+    uring_size_ = URING_SIZE;
+    if (*p == ',')
+        uring_size_ = (int) strtol(p + 1, &p, 10);
 
-    if (!bind_ && !connect_)
-        return 0;
+    if (uring_depth_ < 1)
+        uring_depth_ = URING_DEPTH;
+    if (uring_size_ < 1)
+        uring_size_ = URING_SIZE;
+}
 
-    return 1;
+void zc_zmq_set_trace(const char* spec)
+{
+    strcpy(trace_, spec);
 }
 
-static void zc_zmq_do_read(void)
+void zc_zmq_set_stats(int msec)
 {
-    zmq_msg_t msg;
-    int n;
+    stats_ = msec > 0 ? msec : 0;
+}
 
-    if (! goon_)
-        return;
+void zc_zmq_set_latency(int msec)
+{
+    latency_ = 1;
+    latency_msec_ = msec > 0 ? msec : 0;
+}
 
-    n = zmq_msg_init(&msg);
-    if (n < 0) {
-        if (verbose_)
-            fprintf(stderr, "Message init returned %d (%d), aborting\n",
-                    n, errno);
-        goon_ = 0;
-        return;
-    }
+void zc_zmq_set_huge(int h)
+{
+    huge_ = h;
+}
 
-    n = ZMQ_RECV(sock_, &msg, 0);
-    if (n < 0) {
-        if (verbose_)
-            fprintf(stderr, "Receive returned %d (%d), aborting\n",
-                    n, errno);
-        zmq_msg_close(&msg);
-        goon_ = 0;
-        return;
+void zc_zmq_add_option(const char* opt)
+{
+    if (zc_zmq_parse_option(opt, socket_options, &sopt[nopt], nopt) == 0) {
+        sopt[nopt].sock = -1;
+        ++nopt;
     }
+}
 
-    void* p = zmq_msg_data(&msg);
-    if (verbose_)
-        fprintf(stderr, "Received %d:%p:[%*.*s]\n",
-                n, p, n, n, (char*) p);
-    fwrite(p, 1, n, stdout);
-    fputc(DELIMITER_NEWLINE, stdout);
-    zmq_msg_close(&msg);
+void zc_zmq_add_context_option(const char* opt)
+{
+    if (zc_zmq_parse_option(opt, context_options, &copt[ncopt], ncopt) == 0)
+        ++ncopt;
 }
 
-static void zc_zmq_free(void* buf, void* hint)
+void zc_zmq_add_affinity(const char* spec)
 {
-    int b = (int) hint;
-    if (verbose_)
-        fprintf(stderr, "Freeing buffer #%d:%p\n", b, buf);
-    buffer_free(b);
+    affinity_add(spec, verbose_);
 }
 
-static void zc_zmq_do_write(void)
+void zc_zmq_add_keep(const char* pattern)
 {
-    int b = 0;
-    char* data = 0;
-    int eof = 0;
-    int p = 0;
+    filter_add(FILTER_KEEP, pattern, verbose_);
+}
 
-    if (! goon_)
-        return;
+void zc_zmq_add_drop(const char* pattern)
+{
+    filter_add(FILTER_DROP, pattern, verbose_);
+}
 
-    b = buffer_alloc(&data);
-    if (b < 0 || data == 0) {
-        // BAD!!!
-        goon_ = 0;
+void zc_zmq_add_field(const char* spec)
+{
+    filter_add(FILTER_FIELD, spec, verbose_);
+}
+
+void zc_zmq_run(void)
+{
+    int steps = 0;
+    int j;
+    struct sigaction sa;
+    sigset_t stop;
+
+    if (! zc_zmq_is_valid())
         return;
+
+    if (nsock == 0) {
+        strcpy(ssock[0].type, type_);
+        ssock[0].stype = stype_;
+        ssock[0].bind = -1;
+        nsock = 1;
     }
-    while (1) {
-        int c = fgetc(stdin);
-        if (c == EOF) {
-            if (verbose_)
-                fprintf(stderr, "Found EOF\n");
-            eof = 1;
-            goon_ = 0;
+    if (proxy_ && strchr(capture_, ',') != 0) {
+        int n = nsock;
+        zc_zmq_add_socket(capture_);
+        if (nsock == n)
+            return;
+        capture_sock_ = n;
+        if (ssock[n].stype != ZMQ_PUSH && ssock[n].stype != ZMQ_PUB) {
+            printf("Capture needs a %s or %s socket\n",
+                   SOCKET_TYPE_PUSH, SOCKET_TYPE_PUB);
+            return;
+        }
+    }
+    if (journal_[0] || replay_[0]) {
+        if ((journal_[0] && replay_[0]) || zc_zmq_is_request() ||
+            proxy_ || bench_[0] || exec_[0]) {
+            printf("A journal is either written from %s / %s sockets or replayed to %s / %s ones\n",
+                   SOCKET_TYPE_PULL, SOCKET_TYPE_SUB,
+                   SOCKET_TYPE_PUSH, SOCKET_TYPE_PUB);
+            return;
+        }
+        read_ = journal_[0] != 0;
+        write_ = replay_[0] != 0;
+    }
+    if (shards_[0]) {
+        if (journal_[0] || replay_[0] || segment_[0] || zc_zmq_is_request() ||
+            proxy_ || bench_[0] || exec_[0] ||
+            ssock[0].stype == ZMQ_PUSH || ssock[0].stype == ZMQ_PUB) {
+            printf("Shards are written from %s / %s sockets, instead of stdout\n",
+                   SOCKET_TYPE_PULL, SOCKET_TYPE_SUB);
+            return;
+        }
+        read_ = 1;
+        write_ = 0;
+    }
+    if (route_) {
+        if (! write_ || replay_[0] || zc_zmq_is_request() ||
+            proxy_ || bench_[0] || exec_[0] ||
+            ssock[0].stype == ZMQ_PULL || ssock[0].stype == ZMQ_SUB) {
+            printf("Routing by key needs %s / %s sockets to write to\n",
+                   SOCKET_TYPE_PUSH, SOCKET_TYPE_PUB);
+            return;
+        }
+        if (nsock == 1 && zc_zmq_split_socket() < 0)
+            return;
+    }
+    if ((shards_[0] || route_) && key_init(key_) < 0)
+        return;
+    for (j = 0; j < nsock; ++j) {
+        int t = ssock[j].stype;
+        if (ssock[j].bind < 0)
+            ssock[j].bind = bind_;
+        if (nsock == 1 && ! proxy_)
+            continue;
+        if (t == ZMQ_REQ || t == ZMQ_REP ||
+            t == ZMQ_DEALER || t == ZMQ_ROUTER || bench_[0]) {
+            printf("Socket type %s cannot be used with other sockets\n",
+                   ssock[j].type);
+            return;
+        }
+        if (proxy_)
+            continue;
+        if ((read_ && (t == ZMQ_PUSH || t == ZMQ_PUB)) ||
+            (write_ && (t == ZMQ_PULL || t == ZMQ_SUB))) {
+            printf("Socket type %s cannot %s\n",
+                   ssock[j].type, read_ ? "read" : "write");
+            return;
+        }
+    }
+
+    if (proxy_) {
+        // SIGUSR2 is only ever taken from a signalfd, so that it cannot
+        // interrupt a send waiting at the high water mark; block it before
+        // any thread starts, so that none of them gets it either.
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &mask, 0);
+        read_ = 0;
+        write_ = 0;
+    }
+
+    if (exec_[0]) {
+        if (nsock > 1 || stype_ != ZMQ_ROUTER || proxy_ || bench_[0]) {
+            printf("Workers need a single %s socket\n", SOCKET_TYPE_ROUTER);
+            return;
+        }
+        read_ = 0;
+        write_ = 0;
+        if (window_ <= 0)
+            window_ = WORKER_QUEUE;
+        if (workers_ <= 0)
+            workers_ = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (bench_[0]) {
+        if (stype_ != ZMQ_PUSH && stype_ != ZMQ_PUB) {
+            printf("Benchmark needs a %s or %s socket\n",
+                   SOCKET_TYPE_PUSH, SOCKET_TYPE_PUB);
+            return;
+        }
+        read_ = 0;
+        write_ = 1;
+    }
+
+    if (verbose_)
+        fprintf(stderr, "------\n");
+
+    // Every thread started from here on, the libzmq ones included, keeps
+    // SIGINT and SIGTERM blocked; only this thread and the pipeline reader
+    // take them, and they are unblocked here once the handler is set.
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, 0);
+
+    if (trace_[0] && trace_init(trace_, verbose_) < 0)
+        return;
+    buffer_init(verbose_);
+    buffer_set_huge(huge_);
+    stats_init(stats_, verbose_);
+    if (stype_ == ZMQ_DEALER || stype_ == ZMQ_ROUTER) {
+        if (compress_[0] || batch_records_ > 0) {
+            if (verbose_)
+                fprintf(stderr, "Compression and batching are not supported for %s, disabled\n",
+                        type_);
+            compress_[0] = '\0';
+            batch_records_ = 0;
+        }
+        if (window_ <= 0)
+            window_ = 1;
+    }
+    if (route_ && (compress_[0] || batch_records_ > 0)) {
+        // Each record needs its own key, so it must be its own message.
+        if (verbose_)
+            fprintf(stderr, "Compression and batching are not supported when routing by key, disabled\n");
+        compress_[0] = '\0';
+        batch_records_ = 0;
+    }
+    if ((journal_[0] || replay_[0]) && (compress_[0] || batch_records_ > 0)) {
+        // Messages go to and from a journal exactly as they are on the wire.
+        if (verbose_)
+            fprintf(stderr, "Compression and batching are not used with journals, disabled\n");
+        compress_[0] = '\0';
+        batch_records_ = 0;
+    }
+    if ((latency_ && (read_ || zc_zmq_is_request())) || stype_ == ZMQ_DEALER) {
+        latency_all_ = histo_create();
+        latency_now_ = histo_create();
+        latency_next_ = zc_zmq_now_nsec() + latency_msec_ * 1000000L;
+    }
+    if (compress_[0]) {
+        if (compress_init(compress_, verbose_) < 0) {
+            zc_zmq_cleanup();
+            return;
+        }
+        if (write_ || zc_zmq_is_request())
+            compress_start();
+    }
+    reader_set_framing(framing_);
+    mapfile_set_framing(framing_);
+    writer_set_framing(framing_);
+    if (file_[0]) {
+        if (mapfile_open(file_, delimiter_, max_record_, verbose_) < 0) {
+            zc_zmq_cleanup();
+            return;
+        }
+    } else if (bench_[0]) {
+        steps = bench_init(bench_, verbose_);
+        if (steps < 0) {
+            zc_zmq_cleanup();
+            return;
+        }
+    } else if (replay_[0]) {
+        if (journal_open(replay_, verbose_) < 0) {
+            zc_zmq_cleanup();
+            return;
+        }
+    } else if (write_ || zc_zmq_is_request()) {
+        reader_init(STDIN_FILENO, delimiter_, max_record_, verbose_);
+        if (uring_depth_ > 0) {
+            input_ = uring_create(STDIN_FILENO, uring_depth_, uring_size_, verbose_);
+            if (input_ == 0) {
+                zc_zmq_cleanup();
+                return;
+            }
+            reader_set_uring(input_);
+        }
+    }
+    if (batch_records_ > 0 && zc_zmq_is_request()) {
+        if (verbose_)
+            fprintf(stderr, "Batching is not supported for %s, disabled\n",
+                    type_);
+        batch_records_ = 0;
+    }
+    if (read_ || zc_zmq_is_request()) {
+        writer_init(STDOUT_FILENO, MAX_OUTPUT, verbose_);
+        if (segment_[0]) {
+            if (segment_init(segment_, verbose_) < 0) {
+                zc_zmq_cleanup();
+                return;
+            }
+            writer_set_sink(segment_writev);
+        } else if (uring_depth_ > 0 && ! shards_[0] && ! journal_[0]) {
+            output_ = uring_create(STDOUT_FILENO, uring_depth_, uring_size_, verbose_);
+            if (output_ == 0) {
+                zc_zmq_cleanup();
+                return;
+            }
+            writer_set_sink(zc_zmq_uring_sink);
+        }
+    }
+    if (shards_[0] &&
+        shard_init(shards_, delimiter_, framing_, verbose_) < 0) {
+        zc_zmq_cleanup();
+        return;
+    }
+    if (journal_[0] && journal_create(journal_, verbose_) < 0) {
+        zc_zmq_cleanup();
+        return;
+    }
+    if (proxy_ && capture_[0] && capture_sock_ < 0) {
+        capture_fd_ = strcmp(capture_, "-") == 0 ? STDOUT_FILENO :
+            open(capture_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (capture_fd_ < 0) {
+            fprintf(stderr, "Cannot create capture file [%s] (%d)\n",
+                    capture_, errno);
+            zc_zmq_cleanup();
+            return;
+        }
+        writer_init(capture_fd_, MAX_OUTPUT, verbose_);
+    }
+    if (exec_[0]) {
+        workers_ = pool_init(exec_, workers_, delimiter_, max_record_, verbose_);
+        if (workers_ < 0) {
+            zc_zmq_cleanup();
+            return;
+        }
+        stats_set_report(pool_report);
+    }
+
+    ctxt_ = ZMQ_INIT;
+    if (verbose_)
+        fprintf(stderr, "Context created: %p\n", ctxt_);
+    zc_zmq_set_context();
+
+    for (j = 0; j < nsock; ++j) {
+        Sock* q = &ssock[j];
+        int subs = 0;
+        int k;
+
+        q->sock = zmq_socket(ctxt_, q->stype);
+        if (verbose_)
+            fprintf(stderr, "Socket #%d type %s (%d) created: %p\n",
+                    j, q->type, q->stype, q->sock);
+
+        subs = zc_zmq_set_options(q->sock, j);
+
+        if (q->stype == ZMQ_SUB && !subs) {
+            int ret = zmq_setsockopt(q->sock, ZMQ_SUBSCRIBE, 0, 0);
+            if (verbose_)
+                fprintf(stderr, "Socket automatically subscribed to all messages: %d\n",
+                        ret);
+        }
+
+        for (k = 0; k < nadd; ++k) {
+            int ret;
+            if (sadd[k].sock != j)
+                continue;
+            ret = q->bind ? zmq_bind(q->sock, sadd[k].ep)
+                          : zmq_connect(q->sock, sadd[k].ep);
+            if (verbose_) {
+                fprintf(stderr, "Socket %s [%s]: %d",
+                        q->bind ? "bound to" : "connected to",
+                        sadd[k].ep, ret);
+                if (ret < 0)
+                    fprintf(stderr, " (%d)", errno);
+                fprintf(stderr, "\n");
+            }
+        }
+    }
+    sock_ = ssock[0].sock;
+    if (route_)
+        zc_zmq_route_init();
+    if (exec_[0] && zc_zmq_workers_start() < 0) {
+        zc_zmq_cleanup();
+        return;
+    }
+
+    if (verbose_) {
+        fprintf(stderr, "Running loop...\n");
+        fprintf(stderr, "------\n");
+    }
+
+    // Pin this thread only now, so the libzmq I/O threads started by the
+    // sockets above do not inherit its CPUs.
+    affinity_apply(AFFINITY_MAIN);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = zc_zmq_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+    pthread_sigmask(SIG_UNBLOCK, &stop, 0);
+
+    if (bench_[0]) {
+        zc_zmq_bench(steps);
+    } else if (proxy_) {
+        zc_zmq_proxy();
+    } else {
+        zc_zmq_loop();
+    }
+
+    zc_zmq_cleanup();
+}
+
+static void zc_zmq_loop(void)
+{
+    int count = 0;
+
+    goon_ = 1;
+    zc_zmq_start_pipeline();
+    if (zc_zmq_window_start() < 0)
+        goon_ = 0;
+    while (goon_) {
+        int left = drain_;
+        if (iterations_ > 0) {
+            if (count >= iterations_) {
+                if (verbose_)
+                    fprintf(stderr, "Reached %d iterations, aborting\n", iterations_);
+                break;
+            }
+            if (left > iterations_ - count)
+                left = iterations_ - count;
+            batch_left_ = iterations_ - count;
+        }
+        if (exec_[0]) {
+            count += zc_zmq_do_pool();
+        } else if (stype_ == ZMQ_REQ) {
+            zc_zmq_do_write();
+            zc_zmq_do_read(1);
+            ++count;
+        } else if (stype_ == ZMQ_REP) {
+            zc_zmq_do_read(1);
+            zc_zmq_do_write();
+            ++count;
+        } else if (stype_ == ZMQ_DEALER) {
+            count += zc_zmq_do_dealer();
+        } else if (stype_ == ZMQ_ROUTER) {
+            count += zc_zmq_do_router();
+        } else if (read_) {
+            if (nsock > 1)
+                count += zc_zmq_do_poll(left);
+            else
+                count += zc_zmq_do_read(left);
+        } else if (write_) {
+            if (replay_[0])
+                zc_zmq_do_replay();
+            else if (batch_records_ > 0)
+                zc_zmq_do_batch();
+            else
+                zc_zmq_do_write();
+            ++count;
+        } else {
+            if (verbose_)
+                fprintf(stderr, "Invalid loop mode\n");
+            break;
+        }
+    }
+    if (batch_used_ > 0)
+        zc_zmq_send_batch();
+    if (compress_[0])
+        zc_zmq_send_compressed(1);
+    zc_zmq_window_stop();
+}
+
+static void zc_zmq_bench(int steps)
+{
+    BenchPeer peer;
+    int ptype = stype_ == ZMQ_PUB ? ZMQ_SUB : ZMQ_PULL;
+    int ival = BENCH_IDLE_MSEC;
+    int j;
+
+    peer.sock = zmq_socket(ctxt_, ptype);
+    peer.latency = latency_ ? histo_create() : 0;
+    zc_zmq_set_options(peer.sock, -1);
+    zmq_setsockopt(peer.sock, ZMQ_RCVTIMEO, &ival, sizeof(ival));
+    if (ptype == ZMQ_SUB)
+        zmq_setsockopt(peer.sock, ZMQ_SUBSCRIBE, 0, 0);
+    for (j = 0; j < nadd; ++j) {
+        int ret = ssock[0].bind ? zmq_connect(peer.sock, sadd[j].ep)
+                                : zmq_bind(peer.sock, sadd[j].ep);
+        if (verbose_)
+            fprintf(stderr, "Bench peer %s [%s]: %d\n",
+                    ssock[0].bind ? "connected to" : "bound to",
+                    sadd[j].ep, ret);
+    }
+    usleep(BENCH_SETTLE_MSEC * 1000);
+
+    for (j = 0; j < steps && ! interrupted_; ++j) {
+        pthread_t t;
+        char end = 0;
+
+        peer.msgs = peer.bytes = 0;
+        bench_start(j);
+        if (pthread_create(&t, 0, zc_zmq_bench_thread, &peer) != 0) {
+            if (verbose_)
+                fprintf(stderr, "Could not start bench peer thread\n");
+            break;
+        }
+        zc_zmq_loop();
+        zc_zmq_stop_pipeline();
+        zc_zmq_send_msg(&end, 0, 0);
+        pthread_join(t, 0);
+        bench_report(peer.msgs, peer.bytes);
+        if (peer.latency != 0) {
+            histo_print(peer.latency, "latency");
+            histo_reset(peer.latency);
+        }
+    }
+
+    zmq_close(peer.sock);
+    histo_destroy(peer.latency);
+}
+
+static void* zc_zmq_bench_thread(void* arg)
+{
+    BenchPeer* peer = (BenchPeer*) arg;
+
+    while (1) {
+        zmq_msg_t msg;
+        int n;
+
+        zmq_msg_init(&msg);
+        n = ZMQ_RECV(peer->sock, &msg, 0);
+        if (n == STAMP_SIZE && peer->latency != 0 && zc_zmq_more(peer->sock)) {
+            long sent = 0;
+            memcpy(&sent, zmq_msg_data(&msg), STAMP_SIZE);
+            zmq_msg_close(&msg);
+            zmq_msg_init(&msg);
+            n = ZMQ_RECV(peer->sock, &msg, 0);
+            if (n > 0)
+                histo_add(peer->latency, zc_zmq_now_nsec() - sent);
+        }
+        zmq_msg_close(&msg);
+        if (n <= 0) {
+            if (n < 0 && verbose_)
+                fprintf(stderr, "Bench peer receive returned %d (%d)\n",
+                        n, errno);
+            break;
+        }
+        ++peer->msgs;
+        peer->bytes += n;
+    }
+    return 0;
+}
+
+static void zc_zmq_start_pipeline(void)
+{
+    if (! pipeline_ || ! write_ || file_[0] || replay_[0] || zc_zmq_is_request())
+        return;
+
+    queue_ = queue_create(PIPELINE_DEPTH);
+    if (pthread_create(&reader_, 0, zc_zmq_reader_thread, 0) != 0) {
+        if (verbose_)
+            fprintf(stderr, "Could not start reader thread\n");
+        queue_destroy(queue_);
+        queue_ = 0;
+    } else {
+        reader_running_ = 1;
+        if (verbose_)
+            fprintf(stderr, "Started reader thread, queue depth %d\n",
+                    PIPELINE_DEPTH);
+    }
+}
+
+static void zc_zmq_stop_pipeline(void)
+{
+    char* data = 0;
+    int p = 0;
+
+    if (queue_ == 0)
+        return;
+
+    queue_close(queue_);
+    reader_running_ = 0;
+    if (! bench_[0])
+        pthread_kill(reader_, SIGINT);
+    pthread_join(reader_, 0);
+    while (queue_get(queue_, &data, &p) == 0)
+        buffer_free(data);
+    queue_destroy(queue_);
+    queue_ = 0;
+    if (verbose_)
+        fprintf(stderr, "Stopped reader thread\n");
+}
+
+void zc_zmq_debug(void)
+{
+    int major = 0;
+    int minor = 0;
+    int patch = 0;
+    char buf[10];
+    int j;
+
+    if (! verbose_)
+        return;
+
+    if (! zc_zmq_is_valid())
+        return;
+
+    zmq_version(&major, &minor, &patch);
+    fprintf(stderr, "ZQM version used: %d.%d.%d\n", major, minor, patch);
+
+    fprintf(stderr, "       will bind: %d\n", bind_);
+    fprintf(stderr, "    will connect: %d\n", connect_);
+    fprintf(stderr, "       will read: %d\n", read_);
+    fprintf(stderr, "      will write: %d\n", write_);
+    fprintf(stderr, "     socket type: %s (%d)\n", type_, stype_);
+    fprintf(stderr, "       delimiter: %s (%d)\n",
+            zc_zmq_get_delimiter(delimiter_, buf),
+            (int) delimiter_);
+    fprintf(stderr, "         framing: %s\n",
+            framing_ == FRAME_VARINT ? "varint" :
+            framing_ == FRAME_U32 ? "u32" : "none");
+    fprintf(stderr, "      iterations: %d\n", iterations_);
+    fprintf(stderr, "      max record: %d\n", max_record_);
+    fprintf(stderr, "   flush timeout: %d\n", flush_);
+    fprintf(stderr, "     drain batch: %d\n", drain_);
+    fprintf(stderr, "       pipelined: %d\n", pipeline_);
+    fprintf(stderr, "      input file: %s\n", file_);
+    fprintf(stderr, "        segments: %s\n", segment_);
+    fprintf(stderr, "   batch records: %d\n", batch_records_);
+    fprintf(stderr, "     batch bytes: %d\n", batch_bytes_);
+    fprintf(stderr, "      batch usec: %d\n", batch_usec_);
+    fprintf(stderr, "     compression: %s\n", compress_);
+    fprintf(stderr, "       benchmark: %s\n", bench_);
+    fprintf(stderr, "           trace: %s\n", trace_);
+    fprintf(stderr, "  request window: %d%s\n", window_,
+            unordered_ ? " (unordered)" : "");
+    fprintf(stderr, "           proxy: %d\n", proxy_);
+    fprintf(stderr, "         capture: %s\n", capture_);
+    fprintf(stderr, "     coprocesses: %s (%d)\n", exec_, workers_);
+    fprintf(stderr, "         journal: %s\n", journal_);
+    fprintf(stderr, "          replay: %s\n", replay_);
+    fprintf(stderr, "          shards: %s (key %s)\n", shards_, key_);
+    fprintf(stderr, "        io_uring: %d (%d)\n", uring_depth_, uring_size_);
+    fprintf(stderr, "         routing: %s\n",
+            route_ == ROUTE_SPILL ? "spill" : route_ == ROUTE_HASH ? "hash" : "");
+    fprintf(stderr, "  stats interval: %d\n", stats_);
+    fprintf(stderr, "         latency: %d (%d)\n", latency_, latency_msec_);
+    fprintf(stderr, "      huge pages: %d\n", huge_);
+
+    for (j = 0; j < nsock; ++j) {
+        fprintf(stderr, "      socket #%2d: %s (%d), %s\n",
+                j, ssock[j].type, ssock[j].stype,
+                ssock[j].bind < 0 ? "default" :
+                ssock[j].bind ? "bind" : "connect");
+    }
+
+    for (j = 0; j < nadd; ++j) {
+        fprintf(stderr, "     address #%2d: %s (socket #%d)\n",
+                j, sadd[j].ep, sadd[j].sock);
+    }
+
+    for (j = 0; j < nopt; ++j) {
+        fprintf(stderr, "      option #%2d: %s (%d) = [%s] (socket #%d)\n",
+                j, sopt[j].name, sopt[j].id, sopt[j].value, sopt[j].sock);
+    }
+
+    for (j = 0; j < ncopt; ++j) {
+        fprintf(stderr, "     context #%2d: %s (%d) = [%s]\n",
+                j, copt[j].name, copt[j].id, copt[j].value);
+    }
+}
+
+static int zc_zmq_is_valid(void)
+{
+    int j;
+
+    if (stype_ < 0)
+        return 0;
+
+    if (nadd <= 0)
+        return 0;
+
+    if (bind_ || connect_)
+        return 1;
+
+    for (j = 0; j < nsock; ++j) {
+        if (ssock[j].bind < 0)
+            return 0;
+    }
+    return nsock > 0;
+}
+
+static int zc_zmq_do_read(int max)
+{
+    int count = 0;
+
+    while (goon_ && count < max) {
+        zmq_msg_t msg;
+        int n;
+
+        n = zmq_msg_init(&msg);
+        if (n < 0) {
+            if (verbose_)
+                fprintf(stderr, "Message init returned %d (%d), aborting\n",
+                        n, errno);
+            goon_ = 0;
+            break;
+        }
+
+        n = -1;
+        if (count > 0 || zc_zmq_pending() > 0) {
+            n = ZMQ_RECV(sock_, &msg, ZMQ_DONTWAIT);
+            if (n < 0 && errno == EAGAIN) {
+                zmq_pollitem_t item;
+                long t0;
+                stats_add(STATS_RECV_AGAIN, 1);
+                if (count > 0) {
+                    zmq_msg_close(&msg);
+                    break;
+                }
+
+                item.socket = sock_;
+                item.fd = 0;
+                item.events = ZMQ_POLLIN;
+                item.revents = 0;
+                t0 = stats_usec();
+                if (zmq_poll(&item, 1, flush_ * ZMQ_POLL_MSEC) == 0 &&
+                    zc_zmq_flush() < 0)
+                    goon_ = 0;
+                stats_add(STATS_RECV_USEC, stats_usec() - t0);
+            }
+        }
+        if (n < 0 && goon_) {
+            long t0 = stats_usec();
+            n = ZMQ_RECV(sock_, &msg, 0);
+            stats_add(STATS_RECV_USEC, stats_usec() - t0);
+        }
+        if (n < 0) {
+            if (verbose_)
+                fprintf(stderr, "Receive returned %d (%d), aborting\n",
+                        n, errno);
+            TRACE(TRACE_ERROR, TRACE_FAIL, errno, 0, n);
+            zmq_msg_close(&msg);
+            goon_ = 0;
+            break;
+        }
+
+        n = zc_zmq_take(sock_, &msg, n);
+        if (n < 0)
+            break;
+        count += n;
+    }
+
+    if (stype_ == ZMQ_REQ || stype_ == ZMQ_REP)
+        writer_flush();
+    return count;
+}
+
+// Wait for any of the sockets to become readable, then drain them in
+// turn, starting with a different one each time, so that each ready
+// socket gets an equal share of max.
+static int zc_zmq_do_poll(int max)
+{
+    zmq_pollitem_t item[MAX_SOCK];
+    int count = 0;
+    int share;
+    int ready;
+    long t0;
+    int j;
+
+    for (j = 0; j < nsock; ++j) {
+        item[j].socket = ssock[j].sock;
+        item[j].fd = 0;
+        item[j].events = ZMQ_POLLIN;
+        item[j].revents = 0;
+    }
+
+    t0 = stats_usec();
+    ready = zmq_poll(item, nsock,
+                     zc_zmq_pending() > 0 ? flush_ * ZMQ_POLL_MSEC : -1);
+    stats_add(STATS_RECV_USEC, stats_usec() - t0);
+    if (ready < 0) {
+        if (errno != EINTR) {
+            if (verbose_)
+                fprintf(stderr, "Poll returned %d (%d), aborting\n",
+                        ready, errno);
+            goon_ = 0;
+        }
+        return 0;
+    }
+    if (ready == 0) {
+        if (zc_zmq_flush() < 0)
+            goon_ = 0;
+        return 0;
+    }
+
+    share = max / ready > 0 ? max / ready : 1;
+    for (j = 0; j < nsock && goon_ && count < max; ++j) {
+        int k = (next_sock_ + j) % nsock;
+        if (item[k].revents & ZMQ_POLLIN)
+            count += zc_zmq_drain(ssock[k].sock,
+                                  share < max - count ? share : max - count);
+    }
+    next_sock_ = (next_sock_ + 1) % nsock;
+    return count;
+}
+
+static int zc_zmq_drain(void* sock, int max)
+{
+    int count = 0;
+
+    while (goon_ && count < max) {
+        zmq_msg_t msg;
+        int n;
+
+        zmq_msg_init(&msg);
+        n = ZMQ_RECV(sock, &msg, ZMQ_DONTWAIT);
+        if (n < 0) {
+            zmq_msg_close(&msg);
+            if (errno == EAGAIN) {
+                stats_add(STATS_RECV_AGAIN, 1);
+                break;
+            }
+            if (verbose_)
+                fprintf(stderr, "Receive returned %d (%d), aborting\n",
+                        n, errno);
+            TRACE(TRACE_ERROR, TRACE_FAIL, errno, 0, n);
+            goon_ = 0;
+            break;
+        }
+
+        n = zc_zmq_take(sock, &msg, n);
+        if (n < 0)
+            break;
+        count += n;
+    }
+    return count;
+}
+
+// Handle a message of n bytes just received from sock, and close it.
+// Returns the number of records written out, or -1 to stop.
+static int zc_zmq_take(void* sock, zmq_msg_t* msg, int n)
+{
+    int count = 1;
+    void* p;
+
+    if (journal_[0])
+        return zc_zmq_capture(sock, msg, n);
+
+    if (latency_ && zc_zmq_more(sock)) {
+        zc_zmq_stamp(msg, n);
+        zmq_msg_close(msg);
+        zmq_msg_init(msg);
+        n = ZMQ_RECV(sock, msg, 0);
+        if (n < 0) {
+            if (verbose_)
+                fprintf(stderr, "Receive returned %d (%d), aborting\n",
+                        n, errno);
+            TRACE(TRACE_ERROR, TRACE_FAIL, errno, 0, n);
+            zmq_msg_close(msg);
+            goon_ = 0;
+            return -1;
+        }
+    }
+
+    stats_add(STATS_MSGS_IN, 1);
+    stats_add(STATS_BYTES_IN, n);
+    p = zmq_msg_data(msg);
+    TRACE(TRACE_DEBUG, TRACE_RECV, p, (char*) p, n);
+    if (compress_[0] && compress_detect((char*) p, n)) {
+        char* q = 0;
+        n = compress_unpack((char*) p, n, &q);
+        if (n < 0) {
+            fprintf(stderr, "Dropping corrupt compressed message\n");
+            zmq_msg_close(msg);
+            return 1;
+        }
+        p = q;
+    }
+    if (batch_records_ > 0) {
+        count = zc_zmq_put_batch((char*) p, n);
+    } else if (filter_active() && ! filter_match((char*) p, n)) {
+        stats_add(STATS_FILTERED, 1);
+        count = 0;
+    } else if (zc_zmq_output((char*) p, n) < 0) {
+        count = -1;
+    }
+    zmq_msg_close(msg);
+    if (count < 0)
+        goon_ = 0;
+    return count;
+}
+
+// Append a message to the journal as received, with all its frames.
+// Returns 1, or -1 to stop.
+static int zc_zmq_capture(void* sock, zmq_msg_t* msg, int n)
+{
+    int more = 1;
+
+    stats_add(STATS_MSGS_IN, 1);
+    while (1) {
+        more = zc_zmq_more(sock);
+        stats_add(STATS_BYTES_IN, n);
+        TRACE(TRACE_DEBUG, TRACE_RECV, zmq_msg_data(msg),
+              (char*) zmq_msg_data(msg), n);
+        n = journal_put((char*) zmq_msg_data(msg), n, more);
+        zmq_msg_close(msg);
+        if (n < 0 || ! more)
+            break;
+
+        zmq_msg_init(msg);
+        n = ZMQ_RECV(sock, msg, 0);
+        if (n < 0) {
+            if (verbose_)
+                fprintf(stderr, "Receive returned %d (%d), aborting\n",
+                        n, errno);
+            TRACE(TRACE_ERROR, TRACE_FAIL, errno, 0, n);
+            zmq_msg_close(msg);
+            break;
+        }
+    }
+    if (n < 0)
+        goon_ = 0;
+    return n < 0 ? -1 : 1;
+}
+
+// Send the next message from the journal to every socket, frame by
+// frame; frames are sent straight out of the mapping unless tiny.
+static void zc_zmq_do_replay(void)
+{
+    int more = 1;
+    int sent = 1;
+
+    // journal_next only fails before the first frame, so a message is cut
+    // short only by a failed send, which also stops zc.
+    while (more) {
+        char* data = 0;
+        int p = journal_next(&data, &more);
+        int j;
+
+        if (p < 0) {
+            goon_ = 0;
+            return;
+        }
+        TRACE(TRACE_DEBUG, TRACE_SEND, data, data, p);
+        for (j = 0; j < nsock; ++j) {
+            zmq_msg_t msg;
+            if (p <= MAX_INLINE) {
+                zmq_msg_init_size(&msg, p);
+                memcpy(zmq_msg_data(&msg), data, p);
+            } else {
+                journal_hold();
+                zmq_msg_init_data(&msg, data, p, journal_release, 0);
+            }
+            if (zc_zmq_send_frame(ssock[j].sock, &msg, more ? ZMQ_SNDMORE : 0) >= 0)
+                stats_add(STATS_BYTES_OUT, p);
+            else
+                sent = 0;
+            zmq_msg_close(&msg);
+        }
+        if (! sent)
+            return;
+    }
+    stats_add(STATS_MSGS_OUT, 1);
+}
+
+// Write one record read, to stdout or to its shard.
+static int zc_zmq_output(const char* data, int len)
+{
+    if (shards_[0])
+        return shard_put(data, len);
+    return writer_put(data, len, delimiter_);
+}
+
+// Hand what the writer gathered to io_uring; only a flush waits for it
+// to be written.
+static int zc_zmq_uring_sink(const struct iovec* iov, int n, int sync)
+{
+    if (n > 0 && uring_write(output_, iov, n) < 0)
+        return -1;
+    return sync ? uring_flush(output_) : 0;
+}
+
+// Output waiting to be written, to stdout, the journal or the shards.
+static int zc_zmq_pending(void)
+{
+    return writer_pending() + journal_pending() + shard_pending();
+}
+
+static int zc_zmq_flush(void)
+{
+    if (writer_flush() < 0 || shard_flush() < 0)
+        return -1;
+    return journal_flush();
+}
+
+// Whether requests and replies go through stdin and stdout; with -e the
+// workers answer them instead.
+static int zc_zmq_is_request(void)
+{
+    if (exec_[0])
+        return 0;
+    return stype_ == ZMQ_REQ || stype_ == ZMQ_REP ||
+        stype_ == ZMQ_DEALER || stype_ == ZMQ_ROUTER;
+}
+
+static int zc_zmq_window_start(void)
+{
+    int j;
+
+    if (stype_ == ZMQ_DEALER) {
+        req_ = (Request*) calloc(window_, sizeof(Request));
+        req_free_ = (int*) calloc(window_, sizeof(int));
+        req_order_ = (int*) calloc(window_, sizeof(int));
+        if (req_ == 0 || req_free_ == 0 || req_order_ == 0)
+            return -1;
+        for (j = 0; j < window_; ++j) {
+            zmq_msg_init(&req_[j].reply);
+            req_free_[j] = window_ - 1 - j;
+        }
+        req_nfree_ = window_;
+        req_next_ = req_out_ = 0;
+        req_eof_ = 0;
+    } else if (stype_ == ZMQ_ROUTER) {
+        env_ = (Envelope*) calloc(window_, sizeof(Envelope));
+        if (env_ == 0)
+            return -1;
+        env_put_ = env_take_ = 0;
+    }
+    if (verbose_ && (req_ != 0 || env_ != 0))
+        fprintf(stderr, "Keeping up to %d requests outstanding%s\n",
+                window_, unordered_ ? ", unordered" : "");
+    return 0;
+}
+
+static void zc_zmq_window_stop(void)
+{
+    int j;
+
+    if (req_ != 0) {
+        if (writer_flush() < 0)
+            goon_ = 0;
+        if (verbose_ && req_nfree_ < window_)
+            fprintf(stderr, "Gave up on %d outstanding requests\n",
+                    window_ - req_nfree_);
+        for (j = 0; j < window_; ++j)
+            zmq_msg_close(&req_[j].reply);
+    }
+    if (env_ != 0) {
+        for (; env_take_ != env_put_; ++env_take_) {
+            Envelope* e = &env_[env_take_ % window_];
+            for (j = 0; j < e->n; ++j)
+                zmq_msg_close(&e->part[j]);
+        }
+    }
+    free(req_);
+    free(req_free_);
+    free(req_order_);
+    free(env_);
+    req_ = 0;
+    req_free_ = req_order_ = 0;
+    env_ = 0;
+}
+
+// Send requests while the window has room and input is ready, then
+// wait for replies.  In order, a slow reply holds up the window until it
+// arrives; unordered, every free slot can be used.  Returns the number
+// of replies written out.
+static int zc_zmq_do_dealer(void)
+{
+    int count = 0;
+    int open = 0;
+
+    while (1) {
+        int busy = unordered_ ? window_ - req_nfree_ : (int) (req_next_ - req_out_);
+        open = goon_ && ! req_eof_ && busy < window_;
+        if (! open || (busy > 0 && ! zc_zmq_input_ready(0)))
+            break;
+        zc_zmq_send_request();
+    }
+    if (! goon_)
+        return 0;
+    if (req_nfree_ == window_) {
+        if (req_eof_)
+            goon_ = 0;
+        return 0;
+    }
+
+    if (zc_zmq_wait(1, open)) {
+        while (goon_ && count < drain_) {
+            int n = zc_zmq_take_reply();
+            if (n < 0)
+                break;
+            count += n;
+        }
+    }
+    return count;
+}
+
+static void zc_zmq_send_request(void)
+{
+    zmq_msg_t msg;
+    char* data = 0;
+    zmq_free_fn* ffn = 0;
+    unsigned id[2];
+    int p;
+    int k;
+
+    if (iterations_ > 0 && (int) req_next_ >= iterations_) {
+        req_eof_ = 1;
+        return;
+    }
+    p = zc_zmq_next_input(&data, &ffn);
+    if (p < 0) {
+        req_eof_ = 1;
+        return;
+    }
+
+    k = req_free_[--req_nfree_];
+    req_[k].seq = req_next_;
+    req_[k].state = REQUEST_WAITING;
+    req_[k].sent = zc_zmq_now_nsec();
+    if (! unordered_)
+        req_order_[req_next_ % window_] = k;
+    ++req_next_;
+
+    // The id and the empty delimiter form an envelope that REP and
+    // ROUTER peers send back untouched.
+    id[0] = (unsigned) k;
+    id[1] = req_[k].seq;
+    zmq_msg_init_size(&msg, REQUEST_ID_SIZE);
+    memcpy(zmq_msg_data(&msg), id, REQUEST_ID_SIZE);
+    zc_zmq_send_frame(sock_, &msg, ZMQ_SNDMORE);
+    zmq_msg_close(&msg);
+    zmq_msg_init(&msg);
+    zc_zmq_send_frame(sock_, &msg, ZMQ_SNDMORE);
+    zmq_msg_close(&msg);
+
+    if (ffn == 0) {
+        zmq_msg_init_size(&msg, p);
+        memcpy(zmq_msg_data(&msg), data, p);
+    } else {
+        zmq_msg_init_data(&msg, data, p, ffn, 0);
+    }
+    TRACE(TRACE_DEBUG, TRACE_SEND, data, data, p);
+    if (zc_zmq_send_frame(sock_, &msg, 0) >= 0) {
+        stats_add(STATS_MSGS_OUT, 1);
+        stats_add(STATS_BYTES_OUT, p);
+    }
+    zmq_msg_close(&msg);
+}
+
+// Take one reply without waiting; returns the number of records written
+// out, or -1 if there was none.
+static int zc_zmq_take_reply(void)
+{
+    zmq_msg_t part[MAX_ENVELOPE + 1];
+    unsigned id[2];
+    Request* r = 0;
+    int count = 0;
+    int n;
+    int j;
+
+    n = zc_zmq_recv_parts(sock_, part, MAX_ENVELOPE + 1, ZMQ_DONTWAIT);
+    if (n <= 0)
+        return -1;
+
+    if (n >= 2 && zmq_msg_size(&part[0]) == REQUEST_ID_SIZE) {
+        memcpy(id, zmq_msg_data(&part[0]), REQUEST_ID_SIZE);
+        if (id[0] < (unsigned) window_ &&
+            req_[id[0]].state == REQUEST_WAITING && req_[id[0]].seq == id[1])
+            r = &req_[id[0]];
+    }
+    if (r == 0) {
+        fprintf(stderr, "Dropping unexpected reply with %d frames\n", n);
+        for (j = 0; j < n; ++j)
+            zmq_msg_close(&part[j]);
+        return 0;
+    }
+
+    stats_add(STATS_MSGS_IN, 1);
+    stats_add(STATS_BYTES_IN, zmq_msg_size(&part[n - 1]));
+    zc_zmq_add_latency(r->sent, zc_zmq_now_nsec());
+    zmq_msg_move(&r->reply, &part[n - 1]);
+    r->state = REQUEST_DONE;
+    for (j = 0; j < n; ++j)
+        zmq_msg_close(&part[j]);
+
+    while (1) {
+        int k = (int) (r - req_);
+        if (unordered_) {
+            if (r == 0)
+                break;
+        } else {
+            if (req_out_ == req_next_)
+                break;
+            k = req_order_[req_out_ % window_];
+            if (req_[k].state != REQUEST_DONE)
+                break;
+            ++req_out_;
+        }
+        if (writer_put((char*) zmq_msg_data(&req_[k].reply),
+                       zmq_msg_size(&req_[k].reply), delimiter_) < 0)
+            goon_ = 0;
+        zmq_msg_close(&req_[k].reply);
+        zmq_msg_init(&req_[k].reply);
+        req_[k].state = REQUEST_FREE;
+        req_free_[req_nfree_++] = k;
+        ++count;
+        r = 0;
+    }
+    return count;
+}
+
+// Answer the oldest requests whose replies are ready on the input, then
+// take new requests while the window has room.  Returns the number of
+// replies sent.
+static int zc_zmq_do_router(void)
+{
+    int count = 0;
+
+    while (goon_ && env_take_ != env_put_ && zc_zmq_input_ready(0)) {
+        zc_zmq_send_reply();
+        ++count;
+    }
+    if (! goon_ || count > 0)
+        return count;
+
+    // Whoever produces the replies needs to see the requests first.
+    if (writer_pending() > 0 && writer_flush() < 0) {
+        goon_ = 0;
+        return count;
+    }
+    if (zc_zmq_wait(env_put_ - env_take_ < (unsigned) window_,
+                    env_take_ != env_put_)) {
+        int j;
+        for (j = 0; j < drain_ && env_put_ - env_take_ < (unsigned) window_; ++j) {
+            if (zc_zmq_take_request() < 0)
+                break;
+        }
+    }
+    return count;
+}
+
+static int zc_zmq_take_request(void)
+{
+    Envelope* e = &env_[env_put_ % window_];
+    zmq_msg_t part[MAX_ENVELOPE + 1];
+    int n;
+    int j;
+
+    n = zc_zmq_recv_parts(sock_, part, MAX_ENVELOPE + 1, ZMQ_DONTWAIT);
+    if (n <= 0)
+        return -1;
+
+    stats_add(STATS_MSGS_IN, 1);
+    stats_add(STATS_BYTES_IN, zmq_msg_size(&part[n - 1]));
+    TRACE(TRACE_DEBUG, TRACE_RECV, zmq_msg_data(&part[n - 1]),
+          (char*) zmq_msg_data(&part[n - 1]), zmq_msg_size(&part[n - 1]));
+    if (writer_put((char*) zmq_msg_data(&part[n - 1]),
+                   zmq_msg_size(&part[n - 1]), delimiter_) < 0)
+        goon_ = 0;
+    zmq_msg_close(&part[n - 1]);
+
+    e->n = n - 1;
+    for (j = 0; j < e->n; ++j) {
+        zmq_msg_init(&e->part[j]);
+        zmq_msg_move(&e->part[j], &part[j]);
+        zmq_msg_close(&part[j]);
+    }
+    ++env_put_;
+    return 0;
+}
+
+static void zc_zmq_send_reply(void)
+{
+    Envelope* e = &env_[env_take_ % window_];
+    zmq_msg_t msg;
+    char* data = 0;
+    zmq_free_fn* ffn = 0;
+    int p;
+    int j;
+
+    p = zc_zmq_next_input(&data, &ffn);
+    if (p < 0) {
+        goon_ = 0;
+        return;
+    }
+
+    for (j = 0; j < e->n; ++j) {
+        zc_zmq_send_frame(sock_, &e->part[j], ZMQ_SNDMORE);
+        zmq_msg_close(&e->part[j]);
+    }
+    ++env_take_;
+
+    if (ffn == 0) {
+        zmq_msg_init_size(&msg, p);
+        memcpy(zmq_msg_data(&msg), data, p);
+    } else {
+        zmq_msg_init_data(&msg, data, p, ffn, 0);
+    }
+    TRACE(TRACE_DEBUG, TRACE_SEND, data, data, p);
+    if (zc_zmq_send_frame(sock_, &msg, 0) >= 0) {
+        stats_add(STATS_MSGS_OUT, 1);
+        stats_add(STATS_BYTES_OUT, p);
+    }
+    zmq_msg_close(&msg);
+}
+
+// Bind the backend the workers connect to, and start one thread per
+// coprocess.  Returns -1 on errors.
+static int zc_zmq_workers_start(void)
+{
+    int j;
+
+    backend_ = zmq_socket(ctxt_, ZMQ_ROUTER);
+    if (zmq_bind(backend_, WORKER_ENDPOINT) < 0) {
+        fprintf(stderr, "Cannot bind workers to [%s] (%d)\n",
+                WORKER_ENDPOINT, errno);
+        return -1;
+    }
+    ready_put_ = ready_take_ = 0;
+    for (j = 0; j < workers_; ++j) {
+        if (pthread_create(&worker_[j], 0, zc_zmq_worker_thread,
+                           (void*) (intptr_t) j) != 0) {
+            fprintf(stderr, "Cannot start worker thread %d\n", j);
+            break;
+        }
+    }
+    nworker_ = j;
+    if (verbose_)
+        fprintf(stderr, "Started %d workers on [%s]\n", nworker_, WORKER_ENDPOINT);
+    return nworker_ > 0 ? 0 : -1;
+}
+
+static void zc_zmq_workers_stop(void)
+{
+    int j;
+
+    if (backend_ == 0)
+        return;
+
+    pool_stop();
+    for (j = 0; j < nworker_; ++j)
+        pthread_join(worker_[j], 0);
+    if (verbose_ && nworker_ > 0)
+        fprintf(stderr, "Stopped %d workers\n", nworker_);
+    nworker_ = 0;
+    for (; ready_take_ != ready_put_; ++ready_take_)
+        zmq_msg_close(&ready_[ready_take_ % POOL_MAX_WORKERS]);
+    zmq_close(backend_);
+    backend_ = 0;
+}
+
+// Each worker owns one coprocess and a DEALER socket to the backend.  It
+// announces itself with an empty message, and then gets requests as
+// [envelope...][body], which it answers as [envelope...][reply]; every
+// reply also says it is ready for the next request.  A body the pool
+// rejects still gets a reply, an empty one, as REQ clients wait for it.
+static void* zc_zmq_worker_thread(void* arg)
+{
+    int w = (int) (intptr_t) arg;
+    void* sock = zmq_socket(ctxt_, ZMQ_DEALER);
+    zmq_pollitem_t item;
+    zmq_msg_t msg;
+    int linger = 0;
+
+    affinity_apply(AFFINITY_WORKER);
+    zmq_setsockopt(sock, ZMQ_LINGER, &linger, sizeof(linger));
+    if (zmq_connect(sock, WORKER_ENDPOINT) < 0) {
+        fprintf(stderr, "Worker %d cannot connect to [%s] (%d)\n",
+                w, WORKER_ENDPOINT, errno);
+        zmq_close(sock);
+        goon_ = 0;
+        return 0;
+    }
+    // Counters have a single writer, so stay clear of zc_zmq_send_frame.
+    zmq_msg_init(&msg);
+    ZMQ_SEND(sock, &msg, 0);
+    zmq_msg_close(&msg);
+
+    item.socket = sock;
+    item.fd = 0;
+    item.events = ZMQ_POLLIN;
+    while (! pool_stopping()) {
+        zmq_msg_t part[MAX_ENVELOPE + 1];
+        char* reply = 0;
+        int n;
+        int r;
+        int j;
+
+        item.revents = 0;
+        if (zmq_poll(&item, 1, WORKER_POLL_MSEC * ZMQ_POLL_MSEC) <= 0)
+            continue;
+        n = zc_zmq_recv_parts(sock, part, MAX_ENVELOPE + 1, ZMQ_DONTWAIT);
+        if (n <= 0)
+            continue;
+
+        r = pool_call(w, (char*) zmq_msg_data(&part[n - 1]),
+                      zmq_msg_size(&part[n - 1]), &reply);
+        zmq_msg_close(&part[n - 1]);
+        if (r == POOL_REJECTED)
+            r = 0;
+        if (r < 0) {
+            for (j = 0; j < n - 1; ++j)
+                zmq_msg_close(&part[j]);
+            if (! pool_stopping()) {
+                fprintf(stderr, "Coprocess for worker %d is gone, aborting\n", w);
+                goon_ = 0;
+            }
+            break;
+        }
+
+        for (j = 0; j < n - 1; ++j) {
+            ZMQ_SEND(sock, &part[j], ZMQ_SNDMORE);
+            zmq_msg_close(&part[j]);
+        }
+        zmq_msg_init_size(&msg, r);
+        memcpy(zmq_msg_data(&msg), reply, r);
+        ZMQ_SEND(sock, &msg, 0);
+        zmq_msg_close(&msg);
+    }
+    zmq_close(sock);
+    return 0;
+}
+
+// Take replies from the workers and requests from the clients, and hand
+// queued requests to idle workers, oldest first to both.  Requests wait
+// in a FIFO of up to -R entries while every worker is busy; past that,
+// they stay in the socket.  Returns the number of replies sent.
+static int zc_zmq_do_pool(void)
+{
+    zmq_pollitem_t item[2];
+    int count = 0;
+    int n = 1;
+    int ret;
+    int j;
+
+    item[0].socket = backend_;
+    item[0].fd = 0;
+    item[0].events = ZMQ_POLLIN;
+    item[0].revents = 0;
+    if (env_put_ - env_take_ < (unsigned) window_) {
+        item[1].socket = sock_;
+        item[1].fd = 0;
+        item[1].events = ZMQ_POLLIN;
+        item[1].revents = 0;
+        n = 2;
+    }
+
+    // Time out now and then to notice when a worker gives up.
+    ret = zmq_poll(item, n, WORKER_POLL_MSEC * ZMQ_POLL_MSEC);
+    if (ret < 0) {
+        if (errno != EINTR) {
+            if (verbose_)
+                fprintf(stderr, "Poll returned %d (%d), aborting\n", ret, errno);
+            goon_ = 0;
+        }
+        return 0;
+    }
+
+    if (item[0].revents & ZMQ_POLLIN) {
+        for (j = 0; goon_ && j < drain_; ++j) {
+            int r = zc_zmq_take_worker();
+            if (r < 0)
+                break;
+            count += r;
+        }
+    }
+    if (n > 1 && (item[1].revents & ZMQ_POLLIN)) {
+        for (j = 0; goon_ && j < drain_ &&
+                 env_put_ - env_take_ < (unsigned) window_; ++j) {
+            if (zc_zmq_queue_request() < 0)
+                break;
+        }
+    }
+    while (goon_ && ready_take_ != ready_put_ && env_take_ != env_put_)
+        zc_zmq_dispatch();
+    return count;
+}
+
+// Take one message from a worker: its id, and a reply to pass on unless
+// it is just announcing itself.  Returns 1 if a reply went out, 0 if
+// not, or -1 if there was nothing to take.
+static int zc_zmq_take_worker(void)
+{
+    zmq_msg_t part[MAX_ENVELOPE + 2];
+    int n;
+    int j;
+
+    n = zc_zmq_recv_parts(backend_, part, MAX_ENVELOPE + 2, ZMQ_DONTWAIT);
+    if (n <= 0)
+        return -1;
+
+    zmq_msg_init(&ready_[ready_put_ % POOL_MAX_WORKERS]);
+    zmq_msg_move(&ready_[ready_put_ % POOL_MAX_WORKERS], &part[0]);
+    zmq_msg_close(&part[0]);
+    ++ready_put_;
+    if (n == 2 && zmq_msg_size(&part[1]) == 0) {
+        zmq_msg_close(&part[1]);
+        return 0;
+    }
+
+    TRACE(TRACE_DEBUG, TRACE_SEND, zmq_msg_data(&part[n - 1]),
+          (char*) zmq_msg_data(&part[n - 1]), zmq_msg_size(&part[n - 1]));
+    stats_add(STATS_BYTES_OUT, zmq_msg_size(&part[n - 1]));
+    for (j = 1; j < n; ++j) {
+        zc_zmq_send_frame(sock_, &part[j], j < n - 1 ? ZMQ_SNDMORE : 0);
+        zmq_msg_close(&part[j]);
+    }
+    stats_add(STATS_MSGS_OUT, 1);
+    return 1;
+}
+
+// Queue one request from a client, with all its frames.  Returns -1 if
+// there was nothing to take.
+static int zc_zmq_queue_request(void)
+{
+    Envelope* e = &env_[env_put_ % window_];
+    int n;
+
+    n = zc_zmq_recv_parts(sock_, e->part, MAX_ENVELOPE, ZMQ_DONTWAIT);
+    if (n < 0)
+        return -1;
+    if (n == 0)
+        return 0;
+
+    e->n = n;
+    stats_add(STATS_MSGS_IN, 1);
+    stats_add(STATS_BYTES_IN, zmq_msg_size(&e->part[n - 1]));
+    TRACE(TRACE_DEBUG, TRACE_RECV, zmq_msg_data(&e->part[n - 1]),
+          (char*) zmq_msg_data(&e->part[n - 1]), zmq_msg_size(&e->part[n - 1]));
+    ++env_put_;
+    pool_queue(1);
+    return 0;
+}
+
+// Send the oldest queued request to the worker idle the longest.
+static void zc_zmq_dispatch(void)
+{
+    Envelope* e = &env_[env_take_ % window_];
+    zmq_msg_t* id = &ready_[ready_take_ % POOL_MAX_WORKERS];
+    int j;
+
+    zc_zmq_send_frame(backend_, id, ZMQ_SNDMORE);
+    zmq_msg_close(id);
+    ++ready_take_;
+    for (j = 0; j < e->n; ++j) {
+        zc_zmq_send_frame(backend_, &e->part[j], j < e->n - 1 ? ZMQ_SNDMORE : 0);
+        zmq_msg_close(&e->part[j]);
+    }
+    ++env_take_;
+    pool_queue(-1);
+}
+
+// Receive all the frames of one message into part, dropping the message
+// if it has more than max.  Returns the number of frames, 0 if the
+// message was dropped, or -1 if there was nothing to receive.
+static int zc_zmq_recv_parts(void* sock, zmq_msg_t* part, int max, int flags)
+{
+    int n = 0;
+    int more = 1;
+
+    while (more) {
+        zmq_msg_t msg;
+        int r;
+
+        zmq_msg_init(&msg);
+        r = ZMQ_RECV(sock, &msg, flags);
+        if (r < 0) {
+            zmq_msg_close(&msg);
+            if (errno == EAGAIN && n == 0)
+                return -1;
+            if (verbose_)
+                fprintf(stderr, "Receive returned %d (%d), aborting\n",
+                        r, errno);
+            TRACE(TRACE_ERROR, TRACE_FAIL, errno, 0, r);
+            goon_ = 0;
+            break;
+        }
+        flags = 0;
+        more = zc_zmq_more(sock);
+        if (n < max) {
+            zmq_msg_init(&part[n]);
+            zmq_msg_move(&part[n], &msg);
+        }
+        zmq_msg_close(&msg);
+        ++n;
+    }
+
+    if (n > max || ! goon_) {
+        if (n > max)
+            fprintf(stderr, "Dropping message with %d frames\n", n);
+        for (; n > 0; --n) {
+            if (n <= max)
+                zmq_msg_close(&part[n - 1]);
+        }
+        return goon_ ? 0 : -1;
+    }
+    return n;
+}
+
+// Wait until the socket has a message (if sock is set) or the input has
+// data (if input is set), flushing the output when idle.  Returns
+// whether the socket is readable.
+static int zc_zmq_wait(int sock, int input)
+{
+    zmq_pollitem_t item[2];
+    int n = 0;
+    int ret;
+
+    if (sock) {
+        item[n].socket = sock_;
+        item[n].fd = 0;
+        item[n].events = ZMQ_POLLIN;
+        item[n].revents = 0;
+        ++n;
+    }
+    if (input && ! file_[0] && ! bench_[0]) {
+        item[n].socket = 0;
+        item[n].fd = reader_fd();
+        item[n].events = ZMQ_POLLIN;
+        item[n].revents = 0;
+        ++n;
+    }
+    if (n == 0)
+        return 0;
+
+    ret = zmq_poll(item, n, writer_pending() > 0 ? flush_ * ZMQ_POLL_MSEC : -1);
+    if (ret == 0 && writer_flush() < 0)
+        goon_ = 0;
+    return ret > 0 && sock && (item[0].revents & ZMQ_POLLIN);
+}
+
+// Forward every message from the reading sockets to all the writing
+// ones, frame by frame and without copying, until interrupted.
+static void zc_zmq_proxy(void)
+{
+    zmq_pollitem_t item[MAX_SOCK + 1];
+    int front[MAX_SOCK];
+    int back[MAX_SOCK];
+    int nfront = 0;
+    int nback = 0;
+    int count = 0;
+    int paused = 0;
+    sigset_t mask;
+    int j;
+
+    for (j = 0; j < nsock; ++j) {
+        int t = ssock[j].stype;
+        if (j == capture_sock_)
+            continue;
+        if (t == ZMQ_PULL || t == ZMQ_SUB) {
+            item[nfront].socket = ssock[j].sock;
+            item[nfront].fd = 0;
+            item[nfront].events = ZMQ_POLLIN;
+            front[nfront++] = j;
+        } else {
+            back[nback++] = j;
+        }
+    }
+    if (nfront == 0 || nback == 0) {
+        printf("Proxy needs at least one %s / %s and one %s / %s socket\n",
+               SOCKET_TYPE_PULL, SOCKET_TYPE_SUB,
+               SOCKET_TYPE_PUSH, SOCKET_TYPE_PUB);
+        return;
+    }
+
+    // SIGUSR2 was blocked in zc_zmq_run; while paused, only its signalfd
+    // is polled.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    item[nfront].socket = 0;
+    item[nfront].fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    item[nfront].events = ZMQ_POLLIN;
+    if (item[nfront].fd < 0) {
+        fprintf(stderr, "Cannot create signalfd for SIGUSR2 (%d)\n", errno);
+        return;
+    }
+
+    goon_ = 1;
+    while (goon_) {
+        int ready;
+
+        if (iterations_ > 0 && count >= iterations_) {
+            if (verbose_)
+                fprintf(stderr, "Reached %d iterations, aborting\n", iterations_);
+            break;
+        }
+        if (paused && writer_flush() < 0)
+            break;
+
+        for (j = 0; j <= nfront; ++j)
+            item[j].revents = 0;
+        if (paused)
+            ready = zmq_poll(item + nfront, 1, -1);
+        else
+            ready = zmq_poll(item, nfront + 1,
+                             writer_pending() > 0 ? flush_ * ZMQ_POLL_MSEC : -1);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                if (verbose_)
+                    fprintf(stderr, "Poll returned %d (%d), aborting\n",
+                            ready, errno);
+                goon_ = 0;
+            }
+            continue;
+        }
+        if (ready == 0) {
+            if (writer_flush() < 0)
+                goon_ = 0;
+            continue;
+        }
+        if (item[nfront].revents & ZMQ_POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(item[nfront].fd, &info, sizeof(info)) == sizeof(info))
+                paused = ! paused;
+            if (verbose_)
+                fprintf(stderr, "Proxy %s\n", paused ? "paused" : "resumed");
+            continue;
+        }
+
+        for (j = 0; j < nfront && goon_; ++j) {
+            int k = (next_sock_ + j) % nfront;
+            int left = drain_;
+            if (! (item[k].revents & ZMQ_POLLIN))
+                continue;
+            while (goon_ && left-- > 0 &&
+                   (iterations_ <= 0 || count < iterations_) &&
+                   zc_zmq_forward(ssock[front[k]].sock, back, nback) > 0)
+                ++count;
+        }
+        next_sock_ = (next_sock_ + 1) % nfront;
+    }
+    close(item[nfront].fd);
+    writer_flush();
+}
+
+// Forward one message with all its frames, if there is one waiting.
+// Returns 1 if a message went through, 0 if there was none, -1 on errors.
+static int zc_zmq_forward(void* from, const int* back, int nback)
+{
+    int flags = ZMQ_DONTWAIT;
+    int more = 1;
+
+    while (more) {
+        zmq_msg_t msg;
+        int n;
+        int j;
+
+        zmq_msg_init(&msg);
+        n = ZMQ_RECV(from, &msg, flags);
+        if (n < 0) {
+            zmq_msg_close(&msg);
+            if (errno == EAGAIN && flags != 0) {
+                stats_add(STATS_RECV_AGAIN, 1);
+                return 0;
+            }
+            if (verbose_)
+                fprintf(stderr, "Receive returned %d (%d), aborting\n",
+                        n, errno);
+            TRACE(TRACE_ERROR, TRACE_FAIL, errno, 0, n);
+            goon_ = 0;
+            return -1;
+        }
+        // The rest of the frames arrive together with the first one.
+        flags = 0;
+        more = zc_zmq_more(from);
+        stats_add(STATS_MSGS_IN, 1);
+        stats_add(STATS_BYTES_IN, n);
+        TRACE(TRACE_DEBUG, TRACE_RECV, zmq_msg_data(&msg),
+              (char*) zmq_msg_data(&msg), n);
+
+        if (capture_fd_ >= 0 &&
+            writer_put((char*) zmq_msg_data(&msg), n, delimiter_) < 0)
+            goon_ = 0;
+        if (capture_sock_ >= 0) {
+            zmq_msg_t copy;
+            int c;
+            zmq_msg_init(&copy);
+            zmq_msg_copy(&copy, &msg);
+            c = zc_zmq_send_frame(ssock[capture_sock_].sock, &copy,
+                                  more ? ZMQ_SNDMORE : 0);
+            zmq_msg_close(&copy);
+            if (c < 0) {
+                zmq_msg_close(&msg);
+                zc_zmq_discard(from, more);
+                return -1;
+            }
+        }
+
+        for (j = 0; j < nback; ++j) {
+            zmq_msg_t copy;
+            zmq_msg_t* m = &msg;
+            if (j < nback - 1) {
+                zmq_msg_init(&copy);
+                zmq_msg_copy(&copy, &msg);
+                m = &copy;
+            }
+            n = zc_zmq_send_frame(ssock[back[j]].sock, m,
+                                  more ? ZMQ_SNDMORE : 0);
+            if (m != &msg)
+                zmq_msg_close(m);
+            if (n < 0)
+                break;
+        }
+        zmq_msg_close(&msg);
+        if (n < 0) {
+            zc_zmq_discard(from, more);
+            return -1;
+        }
+        stats_add(STATS_MSGS_OUT, 1);
+        stats_add(STATS_BYTES_OUT, n);
+    }
+    return 1;
+}
+
+// Read and drop the frames left of a message, so that a partial one is
+// not left on sock.
+static void zc_zmq_discard(void* sock, int more)
+{
+    while (more) {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (ZMQ_RECV(sock, &msg, 0) < 0)
+            more = 0;
+        else
+            more = zc_zmq_more(sock);
+        zmq_msg_close(&msg);
+    }
+}
+
+static void zc_zmq_signal(int sig)
+{
+    goon_ = 0;
+    interrupted_ = 1;
+
+    // The reader may be waiting in read(2) while this thread took the
+    // signal; pass it on so that the read is interrupted as well.
+    if (reader_running_ && ! pthread_equal(pthread_self(), reader_))
+        pthread_kill(reader_, sig);
+}
+
+static void zc_zmq_free(void* buf, void* hint)
+{
+    TRACE(TRACE_DEBUG, TRACE_FREE, buf, 0, 0);
+    buffer_free((char*) buf);
+}
+
+static int zc_zmq_read_record(char** data)
+{
+    char* rec = 0;
+    int p = bench_[0] ? bench_next(&rec) : reader_next(&rec);
+    if (p < 0)
+        return -1;
+
+    *data = buffer_alloc(p);
+    if (*data == 0) {
+        // BAD!!!
+        return -1;
+    }
+    memcpy(*data, rec, p);
+    return p;
+}
+
+static void* zc_zmq_reader_thread(void* arg)
+{
+    int count = 0;
+
+    affinity_apply(AFFINITY_READER);
+    while (goon_) {
+        char* data = 0;
+        int p;
+
+        if (iterations_ > 0 && count >= iterations_)
+            break;
+
+        p = zc_zmq_read_record(&data);
+        if (p < 0)
+            break;
+
+        if (queue_put(queue_, data, p) < 0) {
+            buffer_free(data);
             break;
         }
-        if (p >= MAX_STR ||
-            c == delimiter_) {
+        ++count;
+    }
+
+    if (verbose_)
+        fprintf(stderr, "Reader thread done after %d records\n", count);
+    queue_close(queue_);
+    buffer_thread_done();
+    return 0;
+}
+
+static void zc_zmq_do_write(void)
+{
+    char* data = 0;
+    int p = 0;
+    zmq_free_fn* ffn = 0;
+
+    if (! goon_)
+        return;
+
+    if (compress_[0] && compress_pending() > 0 && ! zc_zmq_input_ready(0))
+        zc_zmq_send_compressed(1);
+
+    p = zc_zmq_next_input(&data, &ffn);
+    if (p < 0) {
+        goon_ = 0;
+        return;
+    }
+    zc_zmq_send_data(data, p, ffn);
+}
+
+// Get the next record to send; *ffn releases it, or is 0 if the data
+// must be copied.  Returns the record length, or -1 at the end.
+static int zc_zmq_next_input(char** data, zmq_free_fn** ffn)
+{
+    int p = 0;
+
+    *ffn = zc_zmq_free;
+    if (file_[0]) {
+        p = mapfile_next(data);
+        *ffn = mapfile_release;
+    } else if (queue_ != 0) {
+        if (queue_get(queue_, data, &p) < 0)
+            p = -1;
+    } else {
+        p = zc_zmq_read_record(data);
+    }
+    if (p < 0)
+        return -1;
+
+    if (*ffn == mapfile_release) {
+        if (p <= MAX_INLINE)
+            *ffn = 0;
+        else
+            mapfile_hold();
+    }
+    return p;
+}
+
+static long zc_zmq_now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int zc_zmq_input_ready(int usec)
+{
+    if (file_[0] || bench_[0])
+        return 1;
+    if (queue_ != 0)
+        return queue_poll(queue_, usec);
+    return reader_poll(usec / 1000);
+}
+
+static void zc_zmq_do_batch(void)
+{
+    char* data = 0;
+    int p = 0;
+    int owned = 0;
+    int need;
+
+    if (! goon_)
+        return;
+
+    if (batch_count_ > 0) {
+        long left = batch_usec_ - (zc_zmq_now_usec() - batch_start_);
+        if (left <= 0 || ! zc_zmq_input_ready((int) left))
+            zc_zmq_send_batch();
+    }
+    if (compress_[0] && compress_pending() > 0 && ! zc_zmq_input_ready(0))
+        zc_zmq_send_compressed(1);
+
+    if (file_[0]) {
+        p = mapfile_next(&data);
+    } else if (queue_ != 0) {
+        if (queue_get(queue_, &data, &p) < 0)
+            p = -1;
+        owned = 1;
+    } else if (bench_[0]) {
+        p = bench_next(&data);
+    } else {
+        p = reader_next(&data);
+    }
+    if (p < 0) {
+        goon_ = 0;
+        return;
+    }
+
+    need = frame_varint_size(p) + p;
+    if (batch_ != 0 && batch_used_ + need > buffer_size(batch_))
+        zc_zmq_send_batch();
+    if (batch_ == 0) {
+        batch_ = buffer_alloc(need > batch_bytes_ ? need : batch_bytes_);
+        if (batch_ == 0) {
+            if (owned)
+                buffer_free(data);
+            goon_ = 0;
+            return;
+        }
+        batch_start_ = zc_zmq_now_usec();
+    }
+
+    batch_used_ += frame_put_varint(batch_ + batch_used_, p);
+    memcpy(batch_ + batch_used_, data, p);
+    batch_used_ += p;
+    ++batch_count_;
+    if (owned)
+        buffer_free(data);
+
+    if (batch_count_ >= batch_records_ || batch_used_ >= batch_bytes_)
+        zc_zmq_send_batch();
+}
+
+static void zc_zmq_send_batch(void)
+{
+    char* data = batch_;
+    int p = batch_used_;
+
+    if (data == 0)
+        return;
+
+    TRACE(TRACE_INFO, TRACE_BATCH, batch_count_, 0, p);
+    batch_ = 0;
+    batch_used_ = batch_count_ = 0;
+    zc_zmq_send_data(data, p, zc_zmq_free);
+}
+
+// Write out the records of a batch message, but no more than -n still
+// allows.  Returns the number of records written, or -1 to stop.
+static int zc_zmq_put_batch(const char* data, int len)
+{
+    const char* end = data + len;
+    int count = 0;
+
+    while (data < end && count != batch_left_) {
+        unsigned p = 0;
+        int n = frame_get_varint(data, end, &p);
+        if (n <= 0 || p > (unsigned) (end - data - n)) {
+            fprintf(stderr, "Dropping malformed batch of %d bytes\n", len);
             break;
         }
-        data[p++] = c;
+        data += n;
+        if (filter_active() && ! filter_match(data, (int) p)) {
+            stats_add(STATS_FILTERED, 1);
+            data += p;
+            continue;
+        }
+        if (zc_zmq_output(data, (int) p) < 0)
+            return -1;
+        data += p;
+        ++count;
     }
+    if (batch_left_ > 0)
+        batch_left_ -= count;
+    return count;
+}
 
-    if (p > 0 || !eof) {
-        zmq_msg_t msg;
-        int n;
+static void zc_zmq_send_data(char* data, int p, zmq_free_fn* ffn)
+{
+    if (! compress_[0]) {
+        zc_zmq_send_msg(data, p, ffn);
+        return;
+    }
 
-        n = zmq_msg_init_data(&msg, data, p, zc_zmq_free, (void*) b);
-        if (n < 0) {
-            if (verbose_)
-                fprintf(stderr, "Message init returned %d (%d), aborting\n",
-                        n, errno);
+    if (ffn == 0) {
+        char* copy = buffer_alloc(p);
+        if (copy == 0) {
             goon_ = 0;
             return;
         }
+        memcpy(copy, data, p);
+        data = copy;
+        ffn = zc_zmq_free;
+    }
+    while (compress_put(data, p, ffn) < 0) {
+        char* d = 0;
+        int n = 0;
+        CompressFree* f = 0;
+        if (compress_get(&d, &n, &f, 1) == 0)
+            zc_zmq_send_msg(d, n, f);
+    }
+    zc_zmq_send_compressed(stype_ == ZMQ_REQ || stype_ == ZMQ_REP);
+}
+
+static void zc_zmq_send_compressed(int wait)
+{
+    char* data = 0;
+    int p = 0;
+    CompressFree* ffn = 0;
 
+    while (compress_get(&data, &p, &ffn, wait) == 0)
+        zc_zmq_send_msg(data, p, ffn);
+}
+
+static void zc_zmq_send_msg(char* data, int p, zmq_free_fn* ffn)
+{
+    zmq_msg_t msg;
+    int n;
+    int j;
+
+    if (ffn == 0) {
+        n = zmq_msg_init_size(&msg, p);
+        if (n == 0)
+            memcpy(zmq_msg_data(&msg), data, p);
+    } else {
+        n = zmq_msg_init_data(&msg, data, p, ffn, 0);
+    }
+    if (n < 0) {
         if (verbose_)
-            fprintf(stderr, "Sending %d:#%d:%p:[%*.*s]\n",
-                    p, b, data, p, p, data);
+            fprintf(stderr, "Message init returned %d (%d), aborting\n",
+                    n, errno);
+        if (ffn != 0)
+            ffn(data, 0);
+        goon_ = 0;
+        return;
+    }
+
+    TRACE(TRACE_DEBUG, TRACE_SEND, data, data, p);
 
-        n = ZMQ_SEND(sock_, &msg, 0);
+    if (route_) {
+        n = zc_zmq_send_routed(&msg, data, p);
+        if (n < 0) {
+            zmq_msg_close(&msg);
+            return;
+        }
+    }
+
+    // Otherwise every socket gets the message; all but the last one send
+    // a copy, which shares the data instead of duplicating it.
+    for (j = 0; j < nsock && ! route_; ++j) {
+        zmq_msg_t copy;
+        zmq_msg_t* m = &msg;
+
+        if (j < nsock - 1) {
+            zmq_msg_init(&copy);
+            zmq_msg_copy(&copy, &msg);
+            m = &copy;
+        }
+        n = zc_zmq_send_stamped(ssock[j].sock, m, 1);
+        if (m != &msg)
+            zmq_msg_close(m);
         if (n < 0) {
+            zmq_msg_close(&msg);
+            return;
+        }
+    }
+
+    stats_add(STATS_MSGS_OUT, 1);
+    stats_add(STATS_BYTES_OUT, p);
+    zmq_msg_close(&msg);
+}
+
+// Send a message, after a timestamp frame with -L.  Without wait, give up
+// with EAGAIN if the socket is at its HWM; nothing has been sent then.
+static int zc_zmq_send_stamped(void* sock, zmq_msg_t* msg, int wait)
+{
+    int n;
+
+    if (latency_) {
+        zmq_msg_t stamp;
+        long now = zc_zmq_now_nsec();
+        zmq_msg_init_size(&stamp, STAMP_SIZE);
+        memcpy(zmq_msg_data(&stamp), &now, STAMP_SIZE);
+        if (wait)
+            n = zc_zmq_send_frame(sock, &stamp, ZMQ_SNDMORE);
+        else
+            n = ZMQ_SEND(sock, &stamp, ZMQ_SNDMORE | ZMQ_DONTWAIT);
+        zmq_msg_close(&stamp);
+        if (n < 0)
+            return n;
+        // Once the first frame is queued, the rest of the message is too.
+        wait = 1;
+    }
+    if (wait)
+        return zc_zmq_send_frame(sock, msg, 0);
+    return ZMQ_SEND(sock, msg, ZMQ_DONTWAIT);
+}
+
+// Send a record to the socket its key hashes to.  With spill, a socket at
+// its HWM passes the record on to the next one round the ring; when they
+// are all full, wait until any of them has room, so that one stuck peer
+// does not hold up the keys that belong to the others.
+static int zc_zmq_send_routed(zmq_msg_t* msg, const char* data, int p)
+{
+    int start = ring_find(key_hash(data, p));
+    int home = ring_node(start);
+
+    if (route_ != ROUTE_SPILL)
+        return zc_zmq_send_stamped(ssock[home].sock, msg, 1);
+
+    while (goon_) {
+        zmq_pollitem_t item[MAX_SOCK];
+        int point = start;
+        unsigned tried = 0;
+        long t0;
+        int n;
+        int j;
+
+        for (j = 0; j < nsock; ++j) {
+            int node = ring_node(point);
+            n = zc_zmq_send_stamped(ssock[node].sock, msg, 0);
+            if (n >= 0) {
+                if (node != home)
+                    stats_add(STATS_SPILLED, 1);
+                return n;
+            }
+            if (errno != EAGAIN) {
+                if (verbose_)
+                    fprintf(stderr, "Send returned %d (%d), aborting\n",
+                            n, errno);
+                TRACE(TRACE_ERROR, TRACE_FAIL, errno, 0, n);
+                goon_ = 0;
+                return n;
+            }
+            stats_add(STATS_SEND_AGAIN, 1);
+            tried |= 1u << node;
+            while (j + 1 < nsock && (tried & (1u << ring_node(point))))
+                point = ring_next(point);
+        }
+
+        for (j = 0; j < nsock; ++j) {
+            item[j].socket = ssock[j].sock;
+            item[j].fd = 0;
+            item[j].events = ZMQ_POLLOUT;
+            item[j].revents = 0;
+        }
+        t0 = stats_usec();
+        n = zmq_poll(item, nsock, -1);
+        stats_add(STATS_SEND_USEC, stats_usec() - t0);
+        if (n < 0 && errno != EINTR) {
             if (verbose_)
-                fprintf(stderr, "Send returned %d (%d), aborting\n",
+                fprintf(stderr, "Poll returned %d (%d), aborting\n",
                         n, errno);
-            zmq_msg_close(&msg);
             goon_ = 0;
-            return;
         }
+    }
+    return -1;
+}
 
-        zmq_msg_close(&msg);
+static int zc_zmq_send_frame(void* sock, zmq_msg_t* msg, int flags)
+{
+    int n = ZMQ_SEND(sock, msg, flags | ZMQ_DONTWAIT);
+    if (n < 0 && errno == EAGAIN) {
+        long t0 = stats_usec();
+        stats_add(STATS_SEND_AGAIN, 1);
+        n = zc_zmq_send_wait(sock, msg, flags);
+        stats_add(STATS_SEND_USEC, stats_usec() - t0);
+    }
+    if (n < 0) {
+        if (verbose_)
+            fprintf(stderr, "Send returned %d (%d), aborting\n",
+                    n, errno);
+        TRACE(TRACE_ERROR, TRACE_FAIL, errno, 0, n);
+        goon_ = 0;
+    }
+    return n;
+}
+
+// Wait for sock to take msg, a little at a time: a signal taken by the
+// pipeline reader does not interrupt this thread, so check for it here.
+static int zc_zmq_send_wait(void* sock, zmq_msg_t* msg, int flags)
+{
+    zmq_pollitem_t item;
+
+    item.socket = sock;
+    item.fd = 0;
+    item.events = ZMQ_POLLOUT;
+    while (! interrupted_) {
+        int n;
+
+        item.revents = 0;
+        n = zmq_poll(&item, 1, SEND_POLL_MSEC * ZMQ_POLL_MSEC);
+        if (n < 0 && errno != EINTR)
+            return n;
+        if (n <= 0)
+            continue;
+        n = ZMQ_SEND(sock, msg, flags | ZMQ_DONTWAIT);
+        if (n >= 0 || errno != EAGAIN)
+            return n;
+    }
+    errno = EINTR;
+    return -1;
+}
+
+static long zc_zmq_now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int zc_zmq_more(void* sock)
+{
+    ZMQ_MORE_T more = 0;
+    size_t size = sizeof(more);
+    if (zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &size) < 0)
+        return 0;
+    return more != 0;
+}
+
+static void zc_zmq_stamp(zmq_msg_t* msg, int n)
+{
+    long sent = 0;
+    long now;
+
+    if (n != STAMP_SIZE || latency_all_ == 0)
+        return;
+
+    now = zc_zmq_now_nsec();
+    memcpy(&sent, zmq_msg_data(msg), STAMP_SIZE);
+    zc_zmq_add_latency(sent, now);
+}
+
+static void zc_zmq_add_latency(long sent, long now)
+{
+    if (latency_all_ == 0)
+        return;
+
+    histo_add(latency_all_, now - sent);
+    histo_add(latency_now_, now - sent);
+    if (latency_msec_ > 0 && now >= latency_next_) {
+        histo_print(latency_now_, "latency");
+        histo_reset(latency_now_);
+        latency_next_ = now + latency_msec_ * 1000000L;
     }
 }
 
@@ -590,7 +3183,146 @@ static const char* zc_zmq_get_delimiter(char d, char* buf)
     return buf;
 }
 
-static int zc_zmq_set_options(void)
+static int zc_zmq_socket_type(const char* type)
+{
+    if (strcmp(type, SOCKET_TYPE_PUSH) == 0)
+        return ZMQ_PUSH;
+    if (strcmp(type, SOCKET_TYPE_PULL) == 0)
+        return ZMQ_PULL;
+    if (strcmp(type, SOCKET_TYPE_PUB) == 0)
+        return ZMQ_PUB;
+    if (strcmp(type, SOCKET_TYPE_SUB) == 0)
+        return ZMQ_SUB;
+    if (strcmp(type, SOCKET_TYPE_REQ) == 0)
+        return ZMQ_REQ;
+    if (strcmp(type, SOCKET_TYPE_REP) == 0)
+        return ZMQ_REP;
+    if (strcmp(type, SOCKET_TYPE_DEALER) == 0)
+        return ZMQ_DEALER;
+    if (strcmp(type, SOCKET_TYPE_ROUTER) == 0)
+        return ZMQ_ROUTER;
+    return -1;
+}
+
+static int zc_zmq_parse_option(const char* opt, const OptInfo* table,
+                               SockOpt* so, int count)
+{
+    char buf[MAX_STR];
+    char* p = 0;
+    char* q = 0;
+    int j;
+
+    if (count >= MAX_OPT) {
+        printf("Too many options (max is %d): [%s]\n",
+               MAX_OPT, opt);
+        return -1;
+    }
+
+    strcpy(buf, opt);
+    for (p = buf, q = 0; *p != '\0'; ++p) {
+        if (*p == OPT_SEPARATOR) {
+            *p = '\0';
+            q = p+1;
+            break;
+        }
+    }
+
+    if (q == 0) {
+        printf("Invalid option without a valid separator '%c'\n",
+               OPT_SEPARATOR);
+        return -1;
+    }
+
+    for (j = 0; table[j].name != 0; ++j) {
+        if (strcmp(buf, table[j].name) == 0)
+            break;
+    }
+    if (table[j].name == 0 || table[j].id < 0) {
+        printf("Invalid %s option [%s]\n",
+               table == context_options ? "context" : "socket", buf);
+        return -1;
+    }
+
+    strcpy(so->name, buf);
+    so->id = table[j].id;
+    so->kind = table[j].kind;
+    strcpy(so->value, q);
+    return 0;
+}
+
+static void zc_zmq_set_context(void)
+{
+#ifdef ZMQ_IO_THREADS
+    int j;
+
+    for (j = 0; j < ncopt; ++j) {
+        int cpus[AFFINITY_MAX_CPUS];
+        int n = 1;
+        int k;
+        if (copt[j].kind == OPT_CPUS) {
+            n = affinity_parse(copt[j].value, cpus, AFFINITY_MAX_CPUS);
+            if (n < 0)
+                printf("Invalid CPU list [%s]\n", copt[j].value);
+        } else {
+            cpus[0] = atoi(copt[j].value);
+        }
+        for (k = 0; k < n; ++k) {
+            int ret = zmq_ctx_set(ctxt_, copt[j].id, cpus[k]);
+            if (verbose_ || ret < 0)
+                fprintf(stderr, "Context option %s (%d) set to %d (%d)\n",
+                        copt[j].name, copt[j].id, cpus[k], ret);
+        }
+    }
+#endif
+}
+
+// With -E every address gets a socket of its own, so that a record can
+// go to exactly one of them; they all share the options of the first.
+static int zc_zmq_split_socket(void)
+{
+    int first = 1;
+    int k;
+
+    for (k = 0; k < nopt; ++k) {
+        if (sopt[k].sock == 0)
+            sopt[k].sock = -1;
+    }
+    for (k = 0; k < nadd; ++k) {
+        if (first) {
+            first = 0;
+            continue;
+        }
+        if (nsock >= MAX_SOCK) {
+            printf("Too many addresses to route to (max is %d)\n", MAX_SOCK);
+            return -1;
+        }
+        ssock[nsock] = ssock[0];
+        sadd[k].sock = nsock;
+        ++nsock;
+    }
+    return 0;
+}
+
+// Put every socket on the ring by its first address, so that a key keeps
+// going to the same endpoint whatever the order they were given in.
+static void zc_zmq_route_init(void)
+{
+    int j;
+    int k;
+
+    for (j = 0; j < nsock; ++j) {
+        for (k = 0; k < nadd && sadd[k].sock != j; ++k) {
+        }
+        ring_add(k < nadd ? sadd[k].ep : ssock[j].type);
+    }
+    if (verbose_)
+        fprintf(stderr, "Routing by key across %d sockets%s\n",
+                ring_size(), route_ == ROUTE_SPILL ? ", with spillover" : "");
+}
+
+// Set the options given for all sockets, plus those given for socket
+// idx; returns whether any of them subscribed.
+static int zc_zmq_set_options(void* sock, int idx)
 {
     int subs = 0;
     int j;
@@ -598,39 +3330,42 @@ static int zc_zmq_set_options(void)
     for (j = 0; j < nopt; ++j) {
         size_t olen = 0;
         int ival;
+        uint64_t uval;
         int ret;
-        switch (sopt[j].id) {
-        case ZMQ_SUBSCRIBE:
-        case ZMQ_UNSUBSCRIBE:
-        case ZMQ_IDENTITY:
+        if (sopt[j].sock >= 0 && sopt[j].sock != idx)
+            continue;
+        switch (sopt[j].kind) {
+        case OPT_STRING:
             olen = strlen(sopt[j].value);
-            ret = zmq_setsockopt(sock_, sopt[j].id, sopt[j].value, olen);
+            ret = zmq_setsockopt(sock, sopt[j].id, sopt[j].value, olen);
             if (verbose_)
                 fprintf(stderr, "Socket option %s (%d) set to %d:[%s] (%d)\n",
                         sopt[j].name, sopt[j].id,
-                        olen, sopt[j].value, ret);
+                        (int) olen, sopt[j].value, ret);
             if (! subs)
                 subs = (sopt[j].id == ZMQ_SUBSCRIBE);
             break;
 
-        case ZMQ_SNDHWM:
-        case ZMQ_RCVHWM:
-        case ZMQ_SNDBUF:
-        case ZMQ_RCVBUF:
-        case ZMQ_SNDTIMEO:
-        case ZMQ_RCVTIMEO:
-        case ZMQ_LINGER:
-        case ZMQ_BACKLOG:
-        case ZMQ_IPV4ONLY:
+        case OPT_INT:
             ival = atoi(sopt[j].value);
             olen = sizeof(ival);
-            ret = zmq_setsockopt(sock_, sopt[j].id, &ival, olen);
+            ret = zmq_setsockopt(sock, sopt[j].id, &ival, olen);
             if (verbose_)
                 fprintf(stderr, "Socket option %s (%d) set to %d (%d)\n",
                         sopt[j].name, sopt[j].id,
                         ival, ret);
             break;
 
+        case OPT_UINT64:
+            uval = strtoull(sopt[j].value, 0, 0);
+            olen = sizeof(uval);
+            ret = zmq_setsockopt(sock, sopt[j].id, &uval, olen);
+            if (verbose_)
+                fprintf(stderr, "Socket option %s (%d) set to %llu (%d)\n",
+                        sopt[j].name, sopt[j].id,
+                        (unsigned long long) uval, ret);
+            break;
+
         default:
             printf("Don't know how to handle socket option %s (%d)\n",
                    sopt[j].name, sopt[j].id);
@@ -15,9 +15,41 @@ void zc_zmq_set_verbose(int v);
 
 void zc_zmq_set_type(const char* type);
 void zc_zmq_add_address(const char* address);
+void zc_zmq_add_socket(const char* spec);
 void zc_zmq_set_delimiter(char d);
 void zc_zmq_set_iterations(int n);
+void zc_zmq_set_max_record(int m);
+void zc_zmq_set_flush(int msec);
+void zc_zmq_set_drain(int n);
+void zc_zmq_set_pipeline(int p);
+void zc_zmq_set_file(const char* name);
+void zc_zmq_set_segment(const char* spec);
+void zc_zmq_set_framing(const char* framing);
+void zc_zmq_set_batch(const char* spec);
+void zc_zmq_set_compress(const char* spec);
+void zc_zmq_set_bench(const char* spec);
+void zc_zmq_set_window(int n);
+void zc_zmq_set_unordered(int u);
+void zc_zmq_set_proxy(int p);
+void zc_zmq_set_capture(const char* spec);
+void zc_zmq_set_exec(const char* cmd);
+void zc_zmq_set_workers(int n);
+void zc_zmq_set_journal(const char* path);
+void zc_zmq_set_replay(const char* spec);
+void zc_zmq_set_shards(const char* spec);
+void zc_zmq_set_key(const char* spec);
+void zc_zmq_set_route(const char* mode);
+void zc_zmq_set_uring(const char* spec);
+void zc_zmq_set_trace(const char* spec);
+void zc_zmq_set_stats(int msec);
+void zc_zmq_set_latency(int msec);
+void zc_zmq_set_huge(int h);
 void zc_zmq_add_option(const char* opt);
+void zc_zmq_add_context_option(const char* opt);
+void zc_zmq_add_affinity(const char* spec);
+void zc_zmq_add_keep(const char* pattern);
+void zc_zmq_add_drop(const char* pattern);
+void zc_zmq_add_field(const char* spec);
 
 void zc_zmq_run(void);
 void zc_zmq_debug(void);